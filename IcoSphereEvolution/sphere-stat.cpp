@@ -0,0 +1,112 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+/*
+ * Attach to the stats a running sphere publishes and print them once, or
+ * every `-w ms' milliseconds along with the rates between samples.
+ */
+
+Stats*
+attachStats ()
+{
+    Stats* stats;
+    int fd;
+
+    fd = shm_open(STATS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No stats at %s, is the sphere running? %s\n",
+                STATS_SHM_NAME, strerror(errno));
+        exit(1);
+    }
+
+    stats = (Stats*) mmap(NULL, sizeof(Stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", STATS_SHM_NAME, strerror(errno));
+        exit(1);
+    }
+
+    uint32_t version = stats->version.load(std::memory_order_acquire);
+    if (version != STATS_VERSION) {
+        fprintf(stderr, "Stats are version %u, this reads version %u\n",
+                version, STATS_VERSION);
+        exit(1);
+    }
+
+    return stats;
+}
+
+void
+printSample (Stats* stats, StatsSample& v)
+{
+    printf("pid             %u%s\n", stats->pid,
+            kill(stats->pid, 0) == 0 || errno == EPERM ? "" : " (exited)");
+    printf("frames          %llu\n", (unsigned long long) v.frames);
+    printf("frame time      %.3f ms\n", v.frame_ns / 1e6);
+    printf("regen time      %.3f ms\n", v.regen_ns / 1e6);
+    printf("uploaded        %.1f MiB\n", v.upload_bytes / 1048576.0);
+    printf("triangles drawn %llu\n", (unsigned long long) v.triangles);
+    printf("dropped frames  %llu\n", (unsigned long long) v.dropped_frames);
+}
+
+void
+watch (Stats* stats, int interval)
+{
+    StatsSample last, now;
+    double secs = interval / 1000.0;
+    int lines = 0;
+
+    statsRead(stats, last);
+    while (true) {
+        usleep(interval * 1000);
+        statsRead(stats, now);
+
+        if (lines++ % 20 == 0)
+            printf("%8s %10s %10s %10s %12s %8s\n", "fps", "frame ms",
+                    "regen ms", "MiB/s", "tris/s", "dropped");
+        printf("%8.1f %10.3f %10.3f %10.2f %12.0f %8llu\n",
+                (now.frames - last.frames) / secs,
+                now.frame_ns / 1e6, now.regen_ns / 1e6,
+                (now.upload_bytes - last.upload_bytes) / 1048576.0 / secs,
+                (now.triangles - last.triangles) / secs,
+                (unsigned long long) (now.dropped_frames - last.dropped_frames));
+        fflush(stdout);
+        last = now;
+    }
+}
+
+int
+main (int argc, char** argv)
+{
+    StatsSample sample;
+    Stats* stats;
+    int interval = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-w")) {
+            interval = i + 1 < argc ? atoi(argv[++i]) : 1000;
+        } else {
+            fprintf(stderr, "usage: %s [-w ms]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    stats = attachStats();
+    if (interval > 0) {
+        watch(stats, interval);
+    } else {
+        statsRead(stats, sample);
+        printSample(stats, sample);
+    }
+
+    return 0;
+}
@@ -1,11 +1,31 @@
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <cfloat>
+#include <cerrno>
+#include <cctype>
+#include <stdint.h>
 
 #define GL_GLEXT_PROTOTYPES 1
 #define GLM_ENABLE_EXPERIMENTAL
 
 #ifdef __linux__
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <GL/gl.h>
 #include <GL/glext.h>
 #include <GL/glu.h>
@@ -23,6 +43,9 @@
 #include <glm/gtx/euler_angles.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "stats.h"
+#include "trace.h"
+
 using namespace glm;
 using namespace std;
 
@@ -116,6 +139,9 @@ class Camera {
         /* projection matrix (where field of view is setup) */
         glm::mat4 projection();
 
+        /* projection of just a w x h tile of the screen at x, y from bottom left */
+        glm::mat4 projection(int x, int y, int w, int h);
+
         /* the view the camera has in 3D space */
         glm::mat4 view();
 
@@ -159,6 +185,113 @@ class Camera {
         glm::vec4 lefthand; /* vector for left-handed coordinate system */
 };
 
+/*
+ * An offscreen color and depth target, so what gets rendered doesn't depend
+ * on the window or the display it's on.
+ */
+class Framebuffer {
+    public:
+        Framebuffer();
+        Framebuffer(int width, int height);
+        void bind();
+        void destroy();
+
+        /* read back the color buffer as rows of RGBA, bottom row first */
+        void read(vector<unsigned char>& rgba);
+
+        /* copy the color buffer to the window's framebuffer */
+        void blit(int screen_x, int screen_y);
+
+        int width;
+        int height;
+
+    protected:
+        GLuint fbo;
+        GLuint color;
+        GLuint depth;
+};
+
+/*
+ * Closed loop control of subdivision depth, and optionally solid versus
+ * wireframe, to keep the time spent evolving, uploading and drawing the mesh
+ * each frame inside a budget. Quality only drops after a run of frames over
+ * budget and only rises after a longer run with room for the next level, so
+ * it doesn't flap between two levels.
+ */
+class Governor {
+    public:
+        Governor();
+        Governor(float budget_ms, int depth, bool switch_mode);
+
+        /* feed one frame's timings, returns true if depth or mode changed */
+        bool update(double regen_ms, double upload_ms, double draw_ms);
+
+        bool enabled;
+        int depth;
+        bool solid;
+
+    protected:
+        void log(const char* decision);
+
+        float budget;
+        bool switch_mode;
+
+        /* smoothed timings, negative until the first frame */
+        double regen;
+        double upload;
+        double draw;
+
+        int over;           /* frames in a row over budget */
+        int under;          /* frames in a row with room for the next level */
+        int up_after;       /* how many `under' frames it takes to step up */
+        int since_up;       /* frames since the last step up */
+        int cooldown;       /* frames to ignore after a change */
+        bool stuck;         /* over budget at the lowest level, logged once */
+};
+
+/*
+ * A fixed set of threads which split [0, n) into chunks for a kernel. The
+ * calling thread works too, so a pool of zero threads runs serially.
+ */
+class WorkerPool {
+    public:
+        WorkerPool(int threads);
+        ~WorkerPool();
+
+        /* call f(begin, end) over [0, n) and wait for every chunk */
+        template <typename F>
+        void run(int n, F& f, int grain = 256)
+        {
+            dispatch(n, grain, &WorkerPool::trampoline<F>, &f);
+        }
+
+    protected:
+        template <typename F>
+        static void trampoline(void* f, int begin, int end)
+        {
+            (*(F*)f)(begin, end);
+        }
+
+        void dispatch(int n, int grain, void (*fn)(void*, int, int), void* ctx);
+        void work();
+        void loop();
+
+        vector<thread> threads;
+        mutex lock;
+        condition_variable wake;
+        condition_variable done;
+
+        /* the current job, set under `lock' */
+        void (*fn)(void*, int, int);
+        void* ctx;
+        int n;
+        int chunk;
+        atomic<int> next;
+        int pending;
+        unsigned generation;
+        bool quit;
+};
+
 Shader::Shader()
     : vert_shader(0)
     , frag_shader(0)
@@ -465,6 +598,25 @@ Camera::projection()
             (float)screen_x / (float)screen_y, 0.1f, 1000.0f);
 }
 
+/*
+ * The same frustum as above cut down to the tile, so tiles rendered on their
+ * own line up into the full frame.
+ */
+glm::mat4
+Camera::projection(int x, int y, int w, int h)
+{
+    static const float near = 0.1f;
+    float top = near * tanf(glm::radians(fov) / 2.f);
+    float right = top * (float)screen_x / (float)screen_y;
+
+    return glm::frustum(
+            -right + 2.f * right * x / screen_x,
+            -right + 2.f * right * (x + w) / screen_x,
+            -top + 2.f * top * y / screen_y,
+            -top + 2.f * top * (y + h) / screen_y,
+            near, 1000.0f);
+}
+
 void
 Camera::set_mode (CameraMode mode)
 {
@@ -490,23 +642,301 @@ Camera::lookat (glm::vec3 pos, float zoom)
     fps_look(0, 0);
 }
 
-#define NUM_VERTS 180
+Framebuffer::Framebuffer()
+    : width(0)
+    , height(0)
+    , fbo(0)
+    , color(0)
+    , depth(0)
+{ }
+
+Framebuffer::Framebuffer(int width, int height)
+    : width(width)
+    , height(height)
+{
+    glGenFramebuffers(1, &this->fbo);
+    glGenRenderbuffers(1, &this->color);
+    glGenRenderbuffers(1, &this->depth);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_RENDERBUFFER, color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+            GL_RENDERBUFFER, depth);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Framebuffer %dx%d is incomplete.\n", width, height);
+        exit(1);
+    }
+}
+
+void
+Framebuffer::bind()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+    glViewport(0, 0, this->width, this->height);
+}
+
+void
+Framebuffer::destroy()
+{
+    glDeleteFramebuffers(1, &this->fbo);
+    glDeleteRenderbuffers(1, &this->color);
+    glDeleteRenderbuffers(1, &this->depth);
+    this->fbo = 0;
+    this->color = 0;
+    this->depth = 0;
+}
+
+void
+Framebuffer::read(vector<unsigned char>& rgba)
+{
+    rgba.resize(this->width * this->height * 4);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, this->fbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, this->width, this->height,
+            GL_RGBA, GL_UNSIGNED_BYTE, &rgba[0]);
+}
+
+void
+Framebuffer::blit(int screen_x, int screen_y)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, this->fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, this->width, this->height,
+            0, 0, screen_x, screen_y, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+}
+
+/* governed range of depths, each level has 4 times the triangles of the last */
+#define GOVERNOR_MIN_DEPTH 1
+#define GOVERNOR_MAX_DEPTH 7
+
+Governor::Governor()
+    : enabled(false)
+    , depth(0)
+    , solid(false)
+    , budget(0)
+    , switch_mode(false)
+    , regen(-1)
+    , upload(-1)
+    , draw(-1)
+    , over(0)
+    , under(0)
+    , up_after(0)
+    , since_up(0)
+    , cooldown(0)
+    , stuck(false)
+{ }
+
+Governor::Governor(float budget_ms, int depth, bool switch_mode)
+    : enabled(true)
+    , depth(glm::clamp(depth, GOVERNOR_MIN_DEPTH, GOVERNOR_MAX_DEPTH))
+    , solid(false)
+    , budget(budget_ms)
+    , switch_mode(switch_mode)
+    , regen(-1)
+    , upload(-1)
+    , draw(-1)
+    , over(0)
+    , under(0)
+    , up_after(90)
+    , since_up(300)
+    , cooldown(0)
+    , stuck(false)
+{ }
+
+bool
+Governor::update(double regen_ms, double upload_ms, double draw_ms)
+{
+    static const double smoothing = 0.1;
+    static const double headroom = 0.8;
+    static const int over_frames = 15;
+    static const int base_up_after = 90;
+    static const int max_up_after = 90 * 32;
+    static const int settle_frames = 60;
+    static const int revert_window = 300;
+    double cost, next_cost = 0;
+    bool can_rise;
+
+    if (!enabled)
+        return false;
+
+    /* a step up which holds this long was right, go back to trying eagerly */
+    if (++since_up == revert_window)
+        up_after = base_up_after;
+
+    if (cooldown > 0) {
+        cooldown--;
+        return false;
+    }
+
+    if (regen < 0) {
+        regen = regen_ms;
+        upload = upload_ms;
+        draw = draw_ms;
+    } else {
+        regen += smoothing * (regen_ms - regen);
+        upload += smoothing * (upload_ms - upload);
+        draw += smoothing * (draw_ms - draw);
+    }
+    cost = regen + upload + draw;
+
+    /* every level of depth is 4 times the work, filling guessed at twice lines */
+    can_rise = depth < GOVERNOR_MAX_DEPTH || (switch_mode && !solid);
+    if (depth < GOVERNOR_MAX_DEPTH)
+        next_cost = 4 * cost;
+    else if (can_rise)
+        next_cost = 2 * cost;
+
+    over = cost > budget ? over + 1 : 0;
+    under = can_rise && next_cost < headroom * budget ? under + 1 : 0;
+
+    if (over >= over_frames) {
+        if (switch_mode && solid) {
+            solid = false;
+        } else if (depth > GOVERNOR_MIN_DEPTH) {
+            depth--;
+        } else {
+            if (!stuck)
+                log("over budget at the lowest quality");
+            stuck = true;
+            return false;
+        }
+
+        /* the last step up didn't hold, wait longer before trying again */
+        if (since_up < revert_window)
+            up_after = std::min(up_after * 2, max_up_after);
+        since_up = revert_window;
+        log("lower");
+    } else if (under >= up_after) {
+        if (depth < GOVERNOR_MAX_DEPTH)
+            depth++;
+        else
+            solid = true;
+        since_up = 0;
+        log("raise");
+    } else {
+        return false;
+    }
+
+    /* the old timings say nothing about the new level */
+    regen = upload = draw = -1;
+    over = under = 0;
+    cooldown = settle_frames;
+    stuck = false;
+    return true;
+}
+
+void
+Governor::log(const char* decision)
+{
+    fprintf(stderr, "governor: %s, depth %d %s; %.2fms (regen %.2f, upload %.2f, "
+            "draw %.2f) of %.2fms, next raise after %d frames\n",
+            decision, depth, solid ? "solid" : "wireframe",
+            regen + upload + draw, regen, upload, draw, budget, up_after);
+}
+
+WorkerPool::WorkerPool(int count)
+    : fn(NULL)
+    , ctx(NULL)
+    , n(0)
+    , chunk(1)
+    , next(0)
+    , pending(0)
+    , generation(0)
+    , quit(false)
+{
+    for (int i = 0; i < count; i++)
+        threads.push_back(thread(&WorkerPool::loop, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        unique_lock<mutex> l(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+void
+WorkerPool::dispatch(int count, int grain, void (*f)(void*, int, int), void* c)
+{
+    {
+        unique_lock<mutex> l(lock);
+        fn = f;
+        ctx = c;
+        n = count;
+        chunk = std::max(grain, count / (4 * ((int)threads.size() + 1)));
+        next = 0;
+        pending = threads.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    work();
+
+    unique_lock<mutex> l(lock);
+    while (pending > 0)
+        done.wait(l);
+}
+
+/* take chunks of the current job until there are none left */
+void
+WorkerPool::work()
+{
+    TRACE("work");
+    int begin;
+    while ((begin = next.fetch_add(chunk)) < n)
+        fn(ctx, begin, std::min(begin + chunk, n));
+}
+
+void
+WorkerPool::loop()
+{
+    unsigned seen = 0;
+    traceName("worker");
+    unique_lock<mutex> l(lock);
+
+    while (true) {
+        while (!quit && generation == seen)
+            wake.wait(l);
+        if (quit)
+            return;
+        seen = generation;
+
+        l.unlock();
+        work();
+        l.lock();
+
+        if (--pending == 0)
+            done.notify_one();
+    }
+}
+
+/* A mesh to subdivide, xyz per vertex and 3 indices per triangle */
+struct BaseMesh {
+    vector<float> verts;
+    vector<GLuint> tris;
+};
 
 void
-ico_triangle (int a, int b, int c, const float* ico, vector<float>& v)
+ico_triangle (GLuint a, GLuint b, GLuint c, BaseMesh& m)
 {
-    v.push_back(ico[a * 3 + 0]);
-    v.push_back(ico[a * 3 + 1]);
-    v.push_back(ico[a * 3 + 2]);
-    v.push_back(ico[b * 3 + 0]);
-    v.push_back(ico[b * 3 + 1]);
-    v.push_back(ico[b * 3 + 2]);
-    v.push_back(ico[c * 3 + 0]);
-    v.push_back(ico[c * 3 + 1]);
-    v.push_back(ico[c * 3 + 2]);
+    m.tris.push_back(a);
+    m.tris.push_back(b);
+    m.tris.push_back(c);
 }
 
-vector<float>
+BaseMesh
 buildIco()
 {
     static const float X = 0.525731112119133606f;
@@ -528,253 +958,2386 @@ buildIco()
         -Z,  0,  X
     };
 
-    vector<float> v;
+    BaseMesh m;
+    m.verts.assign(ico, ico + 36);
 
     // 5 faces around point 0
-    ico_triangle(0, 11, 5, ico, v);
-    ico_triangle(0, 5, 1, ico, v);
-    ico_triangle(0, 1, 7, ico, v);
-    ico_triangle(0, 7, 10, ico, v);
-    ico_triangle(0, 10, 11, ico, v);
+    ico_triangle(0, 11, 5, m);
+    ico_triangle(0, 5, 1, m);
+    ico_triangle(0, 1, 7, m);
+    ico_triangle(0, 7, 10, m);
+    ico_triangle(0, 10, 11, m);
 
     // 5 adjacent faces
-    ico_triangle(1, 5, 9, ico, v);
-    ico_triangle(5, 11, 4, ico, v);
-    ico_triangle(11, 10, 2, ico, v);
-    ico_triangle(10, 7, 6, ico, v);
-    ico_triangle(7, 1, 8, ico, v);
+    ico_triangle(1, 5, 9, m);
+    ico_triangle(5, 11, 4, m);
+    ico_triangle(11, 10, 2, m);
+    ico_triangle(10, 7, 6, m);
+    ico_triangle(7, 1, 8, m);
 
     // 5 faces around point 3
-    ico_triangle(3, 9, 4, ico, v);
-    ico_triangle(3, 4, 2, ico, v);
-    ico_triangle(3, 2, 6, ico, v);
-    ico_triangle(3, 6, 8, ico, v);
-    ico_triangle(3, 8, 9, ico, v);
+    ico_triangle(3, 9, 4, m);
+    ico_triangle(3, 4, 2, m);
+    ico_triangle(3, 2, 6, m);
+    ico_triangle(3, 6, 8, m);
+    ico_triangle(3, 8, 9, m);
 
     // 5 adjacent faces
-    ico_triangle(4, 9, 5, ico, v);
-    ico_triangle(2, 4, 11, ico, v);
-    ico_triangle(6, 2, 10, ico, v);
-    ico_triangle(8, 6, 7, ico, v);
-    ico_triangle(9, 8, 1, ico, v);
+    ico_triangle(4, 9, 5, m);
+    ico_triangle(2, 4, 11, m);
+    ico_triangle(6, 2, 10, m);
+    ico_triangle(8, 6, 7, m);
+    ico_triangle(9, 8, 1, m);
 
-    return v;
+    return m;
 }
 
-void
-normalize3f (float* v)
+/* A read-only view of a whole file */
+struct MappedFile {
+    const char* data;
+    size_t size;
+};
+
+MappedFile
+mapFile (const char* path)
 {
-    float d = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
-    if (d == 0.0f)
-        d = 0.01;
-    //assert(d != 0.f);
-    v[0] /= d;
-    v[1] /= d;
-    v[2] /= d;
+    struct stat st;
+    MappedFile file;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Could not read %s: %s\n", path,
+                fd < 0 ? strerror(errno) : "empty file");
+        exit(1);
+    }
+
+    file.size = st.st_size;
+    file.data = (const char*) mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file.data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    madvise((void*) file.data, file.size, MADV_WILLNEED);
+
+    return file;
 }
 
-void
-addVertices (float *v, float *n, vector<float> &out)
+inline const char*
+skipSpace (const char* p, const char* end)
 {
-    for (int i = 0; i < 3; i++)
-        out.push_back(v[i]);
-    for (int i = 0; i < 3; i++)
-        out.push_back(n[i]);
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
 }
 
-void
-normCrossProd (float u[3], float v[3], float *out)
+inline const char*
+nextLine (const char* p, const char* end)
 {
-    out[0] = u[1] * v[2] - u[2] * v[1];
-    out[1] = u[2] * v[0] - u[0] * v[2];
-    out[2] = u[0] * v[1] - u[1] * v[0];
-    normalize3f(out);
+    p = (const char*) memchr(p, '\n', end - p);
+    return p ? p + 1 : end;
 }
 
-/* Compute normal for entire face which all vertices of face use */
-void
-faceNorm (float *vA, float *vB, float *vC, float *out)
+/* like strtol but stops at `end', the mapping isn't NUL terminated */
+const char*
+parseInt (const char* p, const char* end, long* out)
 {
-    float d1[3], d2[3];
-    for (int k = 0; k < 3; k++) {
-        d1[k] = vA[k] - vB[k];
-        d2[k] = vB[k] - vC[k];
-    }
-    normCrossProd(d1, d2, out);
+    bool neg = false;
+    long v = 0;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+
+    *out = neg ? -v : v;
+    return p;
 }
 
-void
-subdivide(float* vA, float* vB, float* vC, int depth, vector<float>& out, float percent)
+/* like strtof but stops at `end' */
+const char*
+parseFloat (const char* p, const char* end, float* out)
 {
-    float vAB[3], vBC[3], vCA[3];
-    float norm[3];
-
-    if (depth == 0) {
-        faceNorm(vA, vB, vC, norm);
-        addVertices(vA, norm, out);
-        addVertices(vB, norm, out);
-        addVertices(vC, norm, out);
-        return;
+    double v = 0, scale = 1;
+    bool neg = false;
+    long exp;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            v = v * 10 + (*p - '0');
+            scale *= 10;
+        }
     }
-
-    for (int i = 0; i < 3; i++) {
-        vAB[i] = vA[i] + (vB[i] * percent);
-        vBC[i] = vB[i] + (vC[i] * percent);
-        vCA[i] = vC[i] + (vA[i] * percent);
+    v /= scale;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p = parseInt(p + 1, end, &exp);
+        v *= pow(10.0, (double) exp);
     }
 
-    normalize3f(vAB);
-    normalize3f(vBC);
-    normalize3f(vCA);
-
-    subdivide(vA, vAB, vCA, depth - 1, out, percent);
-    subdivide(vB, vBC, vAB, depth - 1, out, percent);
-    subdivide(vC, vCA, vBC, depth - 1, out, percent);
-    subdivide(vAB, vBC, vCA, depth - 1, out, percent);
+    *out = neg ? -v : v;
+    return p;
 }
 
+/* One slice of an OBJ file, which starts and ends on a line */
+struct ObjChunk {
+    const char* begin;
+    const char* end;
+    GLuint verts;
+    GLuint tris;
+    bool bad;
+};
+
+/* Count the vertices and triangles in a chunk so it can be parsed in place */
 void
-copyPoint(float* v, int index, vector<float>& vertices)
+objCount (ObjChunk& c)
 {
-    v[0] = vertices[index + 0];
-    v[1] = vertices[index + 1];
-    v[2] = vertices[index + 2];
+    const char *p, *end = c.end;
+
+    c.verts = c.tris = 0;
+    for (p = c.begin; p < end; p = nextLine(p, end)) {
+        int refs = 0;
+
+        p = skipSpace(p, end);
+        if (end - p < 2 || (p[1] != ' ' && p[1] != '\t'))
+            continue;
+        if (p[0] == 'v') {
+            c.verts++;
+        } else if (p[0] == 'f') {
+            for (p = skipSpace(p + 1, end); p < end && *p != '\n'; refs++) {
+                while (p < end && !isspace(*p))
+                    p++;
+                p = skipSpace(p, end);
+            }
+            if (refs >= 3)
+                c.tris += refs - 2;
+        }
+    }
 }
 
-vector<float>
-subdivideIco(vector<float>& ico, int depth, float percent)
+/*
+ * Parse a chunk's vertices and triangles into their slots, `v' and `t'. OBJ
+ * indices start at 1 and negative ones count back from the last vertex.
+ */
+void
+objParse (ObjChunk& c, GLuint v, GLuint t, GLuint num_verts, BaseMesh& m)
 {
-    float vA[3], vB[3], vC[3];
+    const char *p, *end = c.end;
+    float *vert = &m.verts[v * 3];
+    GLuint *tri = &m.tris[t * 3];
+
+    c.bad = false;
+    for (p = c.begin; p < end; p = nextLine(p, end)) {
+        p = skipSpace(p, end);
+        if (end - p < 2 || (p[1] != ' ' && p[1] != '\t'))
+            continue;
+
+        if (p[0] == 'v') {
+            p++;
+            for (int k = 0; k < 3; k++)
+                p = parseFloat(skipSpace(p, end), end, vert++);
+            v++;
+        } else if (p[0] == 'f') {
+            long first = 0, prev = 0, idx;
+            int refs = 0;
+
+            for (p = skipSpace(p + 1, end); p < end && *p != '\n'; refs++) {
+                p = parseInt(p, end, &idx);
+                idx = idx < 0 ? (long) v + idx : idx - 1;
+                if (idx < 0 || idx >= (long) num_verts)
+                    c.bad = true;
+
+                /* fan out from the first corner */
+                if (refs == 0)
+                    first = idx;
+                if (refs >= 2) {
+                    *tri++ = first;
+                    *tri++ = prev;
+                    *tri++ = idx;
+                }
+                prev = idx;
+
+                /* skip the texture and normal indices */
+                while (p < end && !isspace(*p))
+                    p++;
+                p = skipSpace(p, end);
+            }
+        }
+    }
+}
 
-    if (percent == 0.0)
-        percent = 0.0001;
+/*
+ * Split the file into chunks on line boundaries, count what each holds in
+ * parallel, then parse every chunk in parallel straight into its place.
+ */
+void
+loadObj (MappedFile& file, WorkerPool& pool, BaseMesh& m)
+{
+    static const size_t chunk_size = 1 << 18;
+    int n = std::min<size_t>(1024, file.size / chunk_size + 1);
+    vector<ObjChunk> chunks(n);
+    vector<GLuint> vert_at(n + 1, 0), tri_at(n + 1, 0);
+    const char* eof = file.data + file.size;
+    const char* p = file.data;
+    bool bad = false;
+
+    for (int i = 0; i < n; i++) {
+        chunks[i].begin = p;
+        p = (i == n - 1) ? eof
+            : std::max(p, nextLine(file.data + file.size * (i + 1) / n - 1, eof));
+        chunks[i].end = p;
+    }
 
-    vector<float> output;
+    auto count = [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            objCount(chunks[i]);
+    };
+    pool.run(n, count, 1);
 
-    // 180 / 9 = 20 faces of 3 triangles each having 3 points
-    for (int i = 0; i < 180; i += 9) {
-        copyPoint(vA, i, ico);
-        copyPoint(vB, i + 3, ico);
-        copyPoint(vC, i + 6, ico);
-        subdivide(vA, vB, vC, depth, output, percent);
+    for (int i = 0; i < n; i++) {
+        vert_at[i + 1] = vert_at[i] + chunks[i].verts;
+        tri_at[i + 1] = tri_at[i] + chunks[i].tris;
     }
+    m.verts.resize(vert_at[n] * 3);
+    m.tris.resize(tri_at[n] * 3);
 
-    return output;
-}
+    auto parse = [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            objParse(chunks[i], vert_at[i], tri_at[i], vert_at[n], m);
+    };
+    pool.run(n, parse, 1);
 
-float
-clamp (float x, float a, float b)
-{
-	if (x < a) return a;
-	if (x > b) return b;
-	return x;
+    for (int i = 0; i < n; i++)
+        bad |= chunks[i].bad;
+    if (bad) {
+        fprintf(stderr, "OBJ face refers to a vertex which doesn't exist\n");
+        exit(1);
+    }
 }
 
-float
-smoothstep (float edge0, float edge1, float x)
+enum PlyType {
+    PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+    PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+};
+
+struct PlyProperty {
+    char name[64];
+    PlyType type;
+    PlyType count_type;     /* PLY_NONE unless this is a list */
+};
+
+struct PlyElement {
+    char name[64];
+    GLuint count;
+    vector<PlyProperty> props;
+};
+
+PlyType
+plyType (const char* name)
 {
-	float t = clamp((x - edge0) / (edge1 - edge0), 0.0, 1.0);
-	return t * t * (3.0 - 2.0 * t);
+    static const char* names[][2] = {
+        { "", "" },
+        { "char", "int8" }, { "uchar", "uint8" },
+        { "short", "int16" }, { "ushort", "uint16" },
+        { "int", "int32" }, { "uint", "uint32" },
+        { "float", "float32" }, { "double", "float64" },
+    };
+    for (int t = PLY_INT8; t <= PLY_FLOAT64; t++)
+        if (!strcmp(name, names[t][0]) || !strcmp(name, names[t][1]))
+            return (PlyType) t;
+    return PLY_NONE;
 }
 
 int
-main(int argc, char** argv)
+plySize (PlyType type)
 {
-    SDL_Window* window;
-    SDL_GLContext glContext;
-    SDL_Event e;
-    GLuint VAO;
-    GLuint VBO;
-
-    SDL_DisplayMode display;
-    GLuint vertex_id;
-    GLuint norm_id;
+    static const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+    return sizes[type];
+}
 
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        fprintf(stderr, "SDL Failed to init: %s\n", SDL_GetError());
-        exit(1);
+/* read a little endian scalar, which may be unaligned */
+double
+plyValue (const char* p, PlyType type)
+{
+    int8_t i8; uint8_t u8; int16_t i16; uint16_t u16;
+    int32_t i32; uint32_t u32; float f32; double f64;
+
+    switch (type) {
+        case PLY_INT8: memcpy(&i8, p, 1); return i8;
+        case PLY_UINT8: memcpy(&u8, p, 1); return u8;
+        case PLY_INT16: memcpy(&i16, p, 2); return i16;
+        case PLY_UINT16: memcpy(&u16, p, 2); return u16;
+        case PLY_INT32: memcpy(&i32, p, 4); return i32;
+        case PLY_UINT32: memcpy(&u32, p, 4); return u32;
+        case PLY_FLOAT32: memcpy(&f32, p, 4); return f32;
+        case PLY_FLOAT64: memcpy(&f64, p, 8); return f64;
+        default: return 0;
     }
+}
 
-	SDL_SetHint("SDL_VIDEO_MINIMIZE_ON_FOCUS_LOSS", "0");
-
-	window = SDL_CreateWindow("Model",
-		SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-		1280, 720, SDL_WINDOW_OPENGL);
-            //1920, 1080, /* these won't be used if FULLSCREEN is given below */
-            //SDL_WINDOW_OPENGL | SDL_WINDOW_FULLSCREEN_DESKTOP | SDL_WINDOW_BORDERLESS);
+/* Read the header and leave `p' at the first byte of the body */
+vector<PlyElement>
+plyHeader (MappedFile& file, const char** p)
+{
+    const char* end = file.data + file.size;
+    vector<PlyElement> elements;
+    char line[256], a[64], b[64], c[64], d[64];
+    bool binary = false;
 
-    if (!window) {
-        fprintf(stderr, "Window could not be created: %s\n", SDL_GetError());
-        SDL_Quit();
+    if (file.size < 4 || memcmp(file.data, "ply\n", 4)) {
+        fprintf(stderr, "Not a PLY file\n");
         exit(1);
     }
 
-    /* Get screen width and height since we're in fullscreen */
-    SDL_GetCurrentDisplayMode(0, &display);
-
-    glContext = SDL_GL_CreateContext(window);
-    if (!glContext) {
-        printf("Could not create OpenGL context: %s\n", SDL_GetError());
-        SDL_DestroyWindow(window);
-        SDL_Quit();
-        exit(1);
+    for (*p = file.data; *p < end; ) {
+        const char* next = nextLine(*p, end);
+        size_t len = std::min<size_t>(next - *p, sizeof(line) - 1);
+        memcpy(line, *p, len);
+        line[len] = '\0';
+        *p = next;
+
+        if (sscanf(line, "format %63s", a) == 1) {
+            binary = !strcmp(a, "binary_little_endian");
+        } else if (sscanf(line, "element %63s %63s", a, b) == 2) {
+            elements.push_back(PlyElement());
+            strcpy(elements.back().name, a);
+            elements.back().count = strtoul(b, NULL, 10);
+        } else if (sscanf(line, "property list %63s %63s %63s", a, b, c) == 3) {
+            PlyProperty prop;
+            strcpy(prop.name, c);
+            prop.count_type = plyType(a);
+            prop.type = plyType(b);
+            if (elements.empty() || !prop.count_type || !prop.type)
+                break;
+            elements.back().props.push_back(prop);
+        } else if (sscanf(line, "property %63s %63s", a, d) == 2) {
+            PlyProperty prop;
+            strcpy(prop.name, d);
+            prop.count_type = PLY_NONE;
+            prop.type = plyType(a);
+            if (elements.empty() || !prop.type)
+                break;
+            elements.back().props.push_back(prop);
+        } else if (!strncmp(line, "end_header", 10)) {
+            if (binary)
+                return elements;
+            break;
+        }
     }
 
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
-            SDL_GL_CONTEXT_PROFILE_CORE);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
-
-#ifdef _WIN32
-    glewInit();
-#endif
-
-    glEnable(GL_DEPTH_TEST);
-
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-
-    SDL_GetCurrentDisplayMode(0, &display);
-    Camera camera(display.w, display.h, ARCBALL);
+    fprintf(stderr, "Only binary_little_endian PLY files are supported\n");
+    exit(1);
+}
 
-    Shader shader(vertex_source, fragment_source);
-    shader.use();
+/*
+ * Binary PLY has fixed size vertices, so they decode in parallel. Faces do
+ * too when every face is a triangle, which is checked as they're read; any
+ * other polygons fall back to walking the faces one by one.
+ */
+void
+loadPly (MappedFile& file, WorkerPool& pool, BaseMesh& m)
+{
+    const char* eof = file.data + file.size;
+    const char* p;
+    vector<PlyElement> elements = plyHeader(file, &p);
+    GLuint num_verts = 0;
+    bool have_verts = false, have_faces = false, truncated = false;
+    bool negative = false;
+    atomic<bool> bad(false);
+
+    for (size_t e = 0; e < elements.size() && !(have_verts && have_faces); e++) {
+        PlyElement& el = elements[e];
+        int stride = 0, list = -1, list_at = 0, lists = 0;
+
+        for (size_t i = 0; i < el.props.size(); i++) {
+            if (el.props[i].count_type != PLY_NONE) {
+                lists++;
+                list = i;
+                list_at = stride;
+                stride += plySize(el.props[i].count_type);
+            } else {
+                stride += plySize(el.props[i].type);
+            }
+        }
 
-    auto ico = buildIco();
-    auto vertices = subdivideIco(ico, 3, 1.0);
+        if (!strcmp(el.name, "vertex") && lists == 0) {
+            int at[3] = { -1, -1, -1 };
+            PlyType type[3] = { PLY_NONE, PLY_NONE, PLY_NONE };
+
+            for (size_t i = 0, off = 0; i < el.props.size(); i++) {
+                int k = el.props[i].name[1] ? -1 : el.props[i].name[0] - 'x';
+                if (k >= 0 && k < 3) {
+                    at[k] = off;
+                    type[k] = el.props[i].type;
+                }
+                off += plySize(el.props[i].type);
+            }
+            if (at[0] < 0 || at[1] < 0 || at[2] < 0 ||
+                    (size_t)(eof - p) < (size_t) el.count * stride)
+                break;
+
+            num_verts = el.count;
+            m.verts.resize(num_verts * 3);
+            auto decode = [&](int begin, int end) {
+                for (int v = begin; v < end; v++)
+                    for (int k = 0; k < 3; k++)
+                        m.verts[v * 3 + k] = plyValue(p + (size_t) v * stride + at[k], type[k]);
+            };
+            pool.run(num_verts, decode);
+
+            p += (size_t) el.count * stride;
+            have_verts = true;
+        } else if (!strcmp(el.name, "face") && lists == 1) {
+            PlyType count_type = el.props[list].count_type;
+            PlyType index_type = el.props[list].type;
+            int csize = plySize(count_type), isize = plySize(index_type);
+            int tri_stride = stride + 3 * isize;
+            int after = stride - list_at - csize;
+            atomic<bool> polygons(false);
+            atomic<bool> bad_tris(false);
+
+            if (!have_verts)
+                break;
+
+            if ((size_t)(eof - p) >= (size_t) el.count * tri_stride) {
+                m.tris.resize(el.count * 3);
+                auto decode = [&](int begin, int end) {
+                    for (int f = begin; f < end; f++) {
+                        const char* q = p + (size_t) f * tri_stride + list_at;
+                        if (plyValue(q, count_type) != 3) {
+                            polygons = true;
+                            return;
+                        }
+                        for (int k = 0; k < 3; k++) {
+                            double idx = plyValue(q + csize + k * isize, index_type);
+                            if (idx < 0 || idx >= num_verts)
+                                bad_tris = true;
+                            m.tris[f * 3 + k] = idx;
+                        }
+                    }
+                };
+                pool.run(el.count, decode);
+            } else {
+                polygons = true;
+            }
 
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    /* reserve size of vertices buffer */
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+            /* past a polygon the offsets are wrong, so only trust triangles */
+            if (!polygons && bad_tris)
+                bad = true;
+
+            if (polygons) {
+                const char* q = p;
+                m.tris.clear();
+                for (GLuint f = 0; f < el.count && !truncated && !negative; f++) {
+                    int count;
+                    if (eof - q < stride) {
+                        truncated = true;
+                        break;
+                    }
+                    q += list_at;
+                    count = plyValue(q, count_type);
+                    q += csize;
+                    if (count < 0) {
+                        negative = true;
+                        break;
+                    }
+                    if (eof - q < (long) count * isize + after) {
+                        truncated = true;
+                        break;
+                    }
+                    for (int k = 2; k < count; k++) {
+                        double idx[3] = {
+                            plyValue(q, index_type),
+                            plyValue(q + (k - 1) * isize, index_type),
+                            plyValue(q + k * isize, index_type),
+                        };
+                        for (int j = 0; j < 3; j++) {
+                            if (idx[j] < 0 || idx[j] >= num_verts)
+                                bad = true;
+                            m.tris.push_back(idx[j]);
+                        }
+                    }
+                    q += count * isize + after;
+                }
+            }
+            have_faces = true;
+        } else if (lists == 0) {
+            p += (size_t) el.count * stride;
+        } else {
+            break;
+        }
+    }
+
+    if (!have_verts || !have_faces) {
+        fprintf(stderr, "PLY file needs vertex x, y, z and face vertex lists\n");
+        exit(1);
+    }
+    if (truncated) {
+        fprintf(stderr, "PLY file ends part way through its faces\n");
+        exit(1);
+    }
+    if (negative) {
+        fprintf(stderr, "PLY face has a negative vertex count\n");
+        exit(1);
+    }
+    if (bad) {
+        fprintf(stderr, "PLY face refers to a vertex which doesn't exist\n");
+        exit(1);
+    }
+}
+
+/*
+ * Subdivision projects new vertices onto the unit sphere, so move the base
+ * mesh to the origin and scale it to just fit inside it too.
+ */
+void
+fitUnitSphere (BaseMesh& m)
+{
+    float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    float ctr[3], r = 0;
+
+    for (size_t i = 0; i < m.verts.size(); i += 3) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], m.verts[i + k]);
+            hi[k] = std::max(hi[k], m.verts[i + k]);
+        }
+    }
+    for (int k = 0; k < 3; k++)
+        ctr[k] = (lo[k] + hi[k]) / 2;
+
+    for (size_t i = 0; i < m.verts.size(); i += 3) {
+        float d[3];
+        for (int k = 0; k < 3; k++)
+            d[k] = m.verts[i + k] - ctr[k];
+        r = std::max(r, d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    }
+    r = r > 0 ? 1.f / sqrtf(r) : 1.f;
+
+    for (size_t i = 0; i < m.verts.size(); i += 3)
+        for (int k = 0; k < 3; k++)
+            m.verts[i + k] = (m.verts[i + k] - ctr[k]) * r;
+}
+
+/*
+ * Drop faces which use a vertex more than once, which have no fan to walk,
+ * and then vertices no face uses, which scans are full of and which would
+ * otherwise skew the bounds and leave holes in the vertex buffer.
+ */
+void
+compactMesh (BaseMesh& m)
+{
+    vector<GLuint> remap(m.verts.size() / 3, (GLuint)-1);
+    vector<float> kept;
+    size_t tris = 0, verts = 0;
+
+    for (size_t t = 0; t < m.tris.size(); t += 3) {
+        GLuint a = m.tris[t], b = m.tris[t + 1], c = m.tris[t + 2];
+        if (a == b || b == c || c == a)
+            continue;
+        m.tris[tris++] = a;
+        m.tris[tris++] = b;
+        m.tris[tris++] = c;
+    }
+
+    /* first use can come in any order, so copy out rather than in place */
+    for (size_t i = 0; i < tris; i++)
+        if (remap[m.tris[i]] == (GLuint)-1)
+            remap[m.tris[i]] = verts++;
+
+    kept.resize(verts * 3);
+    for (size_t v = 0; v < remap.size(); v++)
+        if (remap[v] != (GLuint)-1)
+            for (int k = 0; k < 3; k++)
+                kept[remap[v] * 3 + k] = m.verts[v * 3 + k];
+    for (size_t i = 0; i < tris; i++)
+        m.tris[i] = remap[m.tris[i]];
+
+    if (tris < m.tris.size() || verts * 3 < m.verts.size())
+        fprintf(stderr, "dropped %lu degenerate faces and %lu unused vertices\n",
+                (m.tris.size() - tris) / 3, m.verts.size() / 3 - verts);
+    m.tris.resize(tris);
+    m.verts.swap(kept);
+}
+
+/* Load an .obj or binary .ply file as the mesh to evolve */
+void
+loadMesh (const char* path, WorkerPool& pool, BaseMesh& m)
+{
+    TRACE("loadMesh");
+    auto start = chrono::steady_clock::now();
+    const char* ext = strrchr(path, '.');
+    MappedFile file;
+
+    if (!ext || (strcasecmp(ext, ".obj") && strcasecmp(ext, ".ply"))) {
+        fprintf(stderr, "Unknown mesh format %s, expected .obj or .ply\n", path);
+        exit(1);
+    }
+
+    file = mapFile(path);
+    if (!strcasecmp(ext, ".obj"))
+        loadObj(file, pool, m);
+    else
+        loadPly(file, pool, m);
+    munmap((void*) file.data, file.size);
+    compactMesh(m);
+
+    if (m.tris.empty()) {
+        fprintf(stderr, "%s has no faces\n", path);
+        exit(1);
+    }
+    fitUnitSphere(m);
+
+    fprintf(stderr, "loaded %s: %lu vertices, %lu triangles in %.1fms\n", path,
+            m.verts.size() / 3, m.tris.size() / 3,
+            chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+}
+
+void
+normalize3f (float* v)
+{
+    float d = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    if (d == 0.0f)
+        d = 0.01;
+    //assert(d != 0.f);
+    v[0] /= d;
+    v[1] /= d;
+    v[2] /= d;
+}
+
+void
+normCrossProd (float u[3], float v[3], float *out)
+{
+    out[0] = u[1] * v[2] - u[2] * v[1];
+    out[1] = u[2] * v[0] - u[0] * v[2];
+    out[2] = u[0] * v[1] - u[1] * v[0];
+    normalize3f(out);
+}
+
+/* Compute normal for entire face which all vertices of face use */
+void
+faceNorm (float *vA, float *vB, float *vC, float *out)
+{
+    float d1[3], d2[3];
+    for (int k = 0; k < 3; k++) {
+        d1[k] = vA[k] - vB[k];
+        d2[k] = vB[k] - vC[k];
+    }
+    normCrossProd(d1, d2, out);
+}
+
+/*
+ * A vertex made during subdivision, normalize(v[a] + v[b] * percent), which
+ * is written to v[dst]. Steps are kept in the order they were made so a
+ * vertex's parents are always evaluated before it is.
+ */
+struct SubdivStep {
+    GLuint dst;
+    GLuint a;
+    GLuint b;
+};
+
+/*
+ * Everything about a subdivided mesh that doesn't change with `percent'. It
+ * is built once per depth so each frame only has to evaluate positions and
+ * normals into an indexed vertex buffer.
+ */
+struct Topology {
+    int depth;
+    GLuint num_verts;
+    vector<float> base;         /* xyz of each base vertex */
+    vector<GLuint> base_dst;    /* where each base vertex lives in the output */
+    vector<SubdivStep> steps;
+    vector<GLuint> indices;     /* 3 per triangle */
+    vector<GLuint> weld;        /* per vertex, the one it meets at percent 1 */
+};
+
+/* modelled post-transform cache size for the optimizer and its statistics */
+#define VCACHE_SIZE 32
+#define VCACHE_FIFO 16
+
+void
+subdivideTopology (GLuint a, GLuint b, GLuint c, int depth, Topology& topo)
+{
+    GLuint ab, bc, ca;
+
+    if (depth == 0) {
+        topo.indices.push_back(a);
+        topo.indices.push_back(b);
+        topo.indices.push_back(c);
+        return;
+    }
+
+    /*
+     * Neighbouring triangles walk their shared edge in opposite directions
+     * and vAB != vBA unless percent is 1, so midpoints are never shared.
+     */
+    ab = topo.num_verts++;
+    bc = topo.num_verts++;
+    ca = topo.num_verts++;
+    topo.steps.push_back({ab, a, b});
+    topo.steps.push_back({bc, b, c});
+    topo.steps.push_back({ca, c, a});
+
+    subdivideTopology(a, ab, ca, depth - 1, topo);
+    subdivideTopology(b, bc, ab, depth - 1, topo);
+    subdivideTopology(c, ca, bc, depth - 1, topo);
+    subdivideTopology(ab, bc, ca, depth - 1, topo);
+}
+
+void
+copyPoint(float* v, int index, vector<float>& vertices)
+{
+    v[0] = vertices[index + 0];
+    v[1] = vertices[index + 1];
+    v[2] = vertices[index + 2];
+}
+
+Topology
+buildTopology(BaseMesh& base, int depth)
+{
+    TRACE("buildTopology");
+    Topology topo;
+
+    topo.depth = depth;
+    topo.num_verts = base.verts.size() / 3;
+    topo.base = base.verts;
+    for (GLuint i = 0; i < topo.num_verts; i++)
+        topo.base_dst.push_back(i);
+
+    for (size_t i = 0; i < base.tris.size(); i += 3)
+        subdivideTopology(base.tris[i], base.tris[i + 1], base.tris[i + 2],
+                depth, topo);
+
+    /*
+     * The two midpoints neighbours make of their shared edge are the same
+     * point of the surface, which connectivity has to see across. Steps
+     * come parents first, so siblings are the midpoints made from the same
+     * pair of welded parents, in either order.
+     */
+    unordered_map<uint64_t, GLuint> made;
+    made.reserve(topo.steps.size());
+    topo.weld.resize(topo.num_verts);
+    for (GLuint i = 0; i < topo.base_dst.size(); i++)
+        topo.weld[i] = i;
+    for (size_t i = 0; i < topo.steps.size(); i++) {
+        SubdivStep& s = topo.steps[i];
+        uint64_t a = topo.weld[s.a], b = topo.weld[s.b];
+        uint64_t key = a < b ? (a << 32) | b : (b << 32) | a;
+        topo.weld[s.dst] = made.insert(make_pair(key, s.dst)).first->second;
+    }
+
+    return topo;
+}
+
+/*
+ * Simulate a FIFO post-transform cache over the index buffer and return the
+ * number of misses, i.e. the number of times a vertex would be transformed.
+ */
+GLuint
+vcacheMisses (vector<GLuint>& indices, GLuint num_verts)
+{
+    vector<GLuint> stamp(num_verts, 0);
+    GLuint misses = 0;
+
+    /* a vertex is in the cache if it was pushed in the last VCACHE_FIFO misses */
+    for (size_t i = 0; i < indices.size(); i++) {
+        GLuint v = indices[i];
+        if (stamp[v] == 0 || misses - stamp[v] >= VCACHE_FIFO)
+            stamp[v] = ++misses;
+    }
+
+    return misses;
+}
+
+/* Score of a vertex, from Tom Forsyth's linear-speed vertex cache optimisation */
+float
+forsythScore (int cache_pos, int live_tris)
+{
+    static const float cache_decay = 1.5f;
+    static const float last_tri_score = 0.75f;
+    static const float valence_scale = 2.0f;
+    static const float valence_power = 0.5f;
+    float score = 0.f;
+
+    if (live_tris == 0)
+        return -1.f;
+
+    if (cache_pos >= 0) {
+        if (cache_pos < 3) {
+            score = last_tri_score;
+        } else {
+            score = 1.f - (cache_pos - 3) * (1.f / (VCACHE_SIZE - 3));
+            score = powf(score, cache_decay);
+        }
+    }
+
+    return score + valence_scale * powf((float)live_tris, -valence_power);
+}
+
+/*
+ * Reorder triangles so consecutive triangles reuse recently transformed
+ * vertices.
+ */
+void
+forsythReorder (vector<GLuint>& indices, GLuint num_verts)
+{
+    GLuint num_tris = indices.size() / 3;
+    vector<GLuint> adj_start(num_verts + 1, 0), adj(indices.size());
+    vector<int> live(num_verts, 0), cache_pos(num_verts, -1);
+    vector<float> vscore(num_verts), tscore(num_tris, 0.f);
+    vector<bool> emitted(num_tris, false);
+    vector<GLuint> out;
+    GLuint cache[VCACHE_SIZE + 3], next_cache[VCACHE_SIZE + 3];
+    int cache_len = 0, next_len;
+    GLuint cursor = 0;
+    int best = -1;
+
+    out.reserve(indices.size());
+
+    /* triangles adjacent to each vertex, packed by vertex */
+    for (size_t i = 0; i < indices.size(); i++)
+        live[indices[i]]++;
+    for (GLuint v = 0; v < num_verts; v++)
+        adj_start[v + 1] = adj_start[v] + live[v];
+    {
+        vector<GLuint> fill(adj_start.begin(), adj_start.end() - 1);
+        for (size_t i = 0; i < indices.size(); i++)
+            adj[fill[indices[i]]++] = i / 3;
+    }
+
+    for (GLuint v = 0; v < num_verts; v++)
+        vscore[v] = forsythScore(-1, live[v]);
+    for (GLuint t = 0; t < num_tris; t++)
+        for (int k = 0; k < 3; k++)
+            tscore[t] += vscore[indices[t * 3 + k]];
+
+    for (GLuint n = 0; n < num_tris; n++) {
+        /* nothing in the cache to continue from, take the next unemitted */
+        if (best < 0) {
+            while (emitted[cursor])
+                cursor++;
+            best = cursor;
+        }
+
+        emitted[best] = true;
+        next_len = 0;
+        for (int k = 0; k < 3; k++) {
+            GLuint v = indices[best * 3 + k];
+            GLuint *first = &adj[adj_start[v]];
+            GLuint *last = first + live[v] - 1;
+
+            out.push_back(v);
+            next_cache[next_len++] = v;
+
+            /* drop the triangle from the vertex's live triangles */
+            while (*first != (GLuint)best)
+                first++;
+            *first = *last;
+            live[v]--;
+        }
+
+        /* emitted vertices move to the front of the cache */
+        for (int i = 0; i < cache_len; i++) {
+            GLuint v = cache[i];
+            if (v != next_cache[0] && v != next_cache[1] && v != next_cache[2])
+                next_cache[next_len++] = v;
+        }
+
+        for (int i = 0; i < next_len; i++) {
+            GLuint v = next_cache[i];
+            cache_pos[v] = i < VCACHE_SIZE ? i : -1;
+            vscore[v] = forsythScore(cache_pos[v], live[v]);
+        }
+
+        /* only triangles touching the cache changed score */
+        best = -1;
+        for (int i = 0; i < next_len; i++) {
+            GLuint v = next_cache[i];
+            for (int j = 0; j < live[v]; j++) {
+                GLuint t = adj[adj_start[v] + j];
+                tscore[t] = vscore[indices[t * 3 + 0]] +
+                            vscore[indices[t * 3 + 1]] +
+                            vscore[indices[t * 3 + 2]];
+                if (i < VCACHE_SIZE && (best < 0 || tscore[t] > tscore[best]))
+                    best = t;
+            }
+        }
+
+        cache_len = next_len < VCACHE_SIZE ? next_len : VCACHE_SIZE;
+        for (int i = 0; i < cache_len; i++)
+            cache[i] = next_cache[i];
+    }
+
+    indices.swap(out);
+}
+
+/*
+ * Renumber vertices in the order the index buffer first uses them so
+ * fetches walk the vertex buffer forward.
+ */
+void
+firstUseReorder (Topology& topo)
+{
+    vector<GLuint> remap(topo.num_verts, (GLuint)-1);
+    GLuint next = 0;
+
+    for (size_t i = 0; i < topo.indices.size(); i++) {
+        GLuint& v = topo.indices[i];
+        if (remap[v] == (GLuint)-1)
+            remap[v] = next++;
+        v = remap[v];
+    }
+
+    /* anything no triangle uses still needs somewhere to be written */
+    for (GLuint v = 0; v < topo.num_verts; v++)
+        if (remap[v] == (GLuint)-1)
+            remap[v] = next++;
+
+    for (size_t i = 0; i < topo.base_dst.size(); i++)
+        topo.base_dst[i] = remap[topo.base_dst[i]];
+
+    vector<GLuint> weld(topo.num_verts);
+    for (GLuint v = 0; v < topo.num_verts; v++)
+        weld[remap[v]] = remap[topo.weld[v]];
+    topo.weld.swap(weld);
+
+    /* step order is untouched so parents are still made before children */
+    for (size_t i = 0; i < topo.steps.size(); i++) {
+        topo.steps[i].dst = remap[topo.steps[i].dst];
+        topo.steps[i].a = remap[topo.steps[i].a];
+        topo.steps[i].b = remap[topo.steps[i].b];
+    }
+}
+
+/*
+ * Optimize the topology for the post-transform vertex cache and then for
+ * fetch locality, reporting ACMR (misses per triangle) and ATVR (misses per
+ * vertex) before and after.
+ */
+void
+optimizeTopology (Topology& topo)
+{
+    TRACE("optimizeTopology");
+    float tris = topo.indices.size() / 3;
+    float verts = topo.num_verts;
+    GLuint before, after;
+
+    before = vcacheMisses(topo.indices, topo.num_verts);
+    forsythReorder(topo.indices, topo.num_verts);
+    firstUseReorder(topo);
+    after = vcacheMisses(topo.indices, topo.num_verts);
+
+    fprintf(stderr, "depth %d: %u triangles, %u vertices, "
+            "ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+            topo.depth, (GLuint)tris, topo.num_verts,
+            before / tris, after / tris, before / verts, after / verts);
+}
+
+/*
+ * Evaluate the topology's vertex positions for `percent' into `out', which
+ * is interleaved position and normal. Normals are left for vertexNormals.
+ */
+void
+subdivideIco(Topology& topo, float percent, vector<float>& out)
+{
+    TRACE("subdivideIco");
+    if (percent == 0.0)
+        percent = 0.0001;
+
+    out.resize(topo.num_verts * 6);
+
+    for (size_t i = 0; i < topo.base_dst.size(); i++) {
+        float *v = &out[topo.base_dst[i] * 6];
+        copyPoint(v, i * 3, topo.base);
+    }
+
+    for (size_t i = 0; i < topo.steps.size(); i++) {
+        float *v = &out[topo.steps[i].dst * 6];
+        float *a = &out[topo.steps[i].a * 6];
+        float *b = &out[topo.steps[i].b * 6];
+        for (int k = 0; k < 3; k++)
+            v[k] = a[k] + (b[k] * percent);
+        normalize3f(v);
+    }
+}
+
+/*
+ * Half-edge connectivity over a topology's index buffer. Half-edge h belongs
+ * to triangle h / 3 and leaves vertex indices[h], so only the twins and where
+ * to start walking around each vertex need storing.
+ *
+ * Midpoints aren't shared, so twins and fans are over welded vertices and a
+ * walk can cross from one copy of a midpoint to its sibling. Every copy then
+ * sees the whole ring around the point of the surface it is part of.
+ */
+struct HalfEdge {
+    vector<int> twin;           /* opposite half-edge, -1 along a boundary */
+    vector<GLuint> fan_start;   /* per welded vertex, its first entry in `fans' */
+    vector<int> fans;           /* half-edge to start each fan walk from */
+    vector<GLuint> valence;     /* per welded vertex, how many faces use it */
+};
+
+inline int
+heNext (int h)
+{
+    return h % 3 == 2 ? h - 2 : h + 1;
+}
+
+inline int
+hePrev (int h)
+{
+    return h % 3 == 0 ? h + 2 : h - 1;
+}
+
+/* The next half-edge leaving the same vertex, or -1 at a seam */
+inline int
+heRotate (HalfEdge& he, int h)
+{
+    return he.twin[hePrev(h)];
+}
+
+HalfEdge
+buildHalfEdge (Topology& topo)
+{
+    TRACE("buildHalfEdge");
+    int n = topo.indices.size();
+    vector<pair<uint64_t, int> > edges(n);
+    vector<int> closed(topo.num_verts, -1);
+    HalfEdge he;
+
+    he.twin.assign(n, -1);
+    he.fan_start.assign(topo.num_verts + 1, 0);
+    he.valence.assign(topo.num_verts, 0);
+
+    /* edges are matched, and fans gathered, on welded vertices */
+    vector<GLuint>& weld = topo.weld;
+    for (int h = 0; h < n; h++) {
+        uint64_t a = weld[topo.indices[h]], b = weld[topo.indices[heNext(h)]];
+        edges[h] = make_pair((a << 32) | b, h);
+    }
+    sort(edges.begin(), edges.end());
+
+    for (int h = 0; h < n; h++) {
+        uint64_t a = weld[topo.indices[h]], b = weld[topo.indices[heNext(h)]];
+        auto it = lower_bound(edges.begin(), edges.end(),
+                make_pair((b << 32) | a, 0));
+        if (a != b && it != edges.end() && it->first == ((b << 32) | a))
+            he.twin[h] = it->second;
+    }
+
+    /*
+     * Where more than two faces share an edge only keep pairs which agree,
+     * so every walk either comes back around or reaches a seam.
+     */
+    for (int h = 0; h < n; h++)
+        if (he.twin[h] >= 0 && he.twin[he.twin[h]] != h)
+            he.twin[h] = -1;
+
+    /*
+     * Walking with heRotate only goes one way around a vertex, so an open fan
+     * starts from the half-edge with nothing before it. A vertex without any
+     * of those has a single closed fan which can start anywhere.
+     */
+    for (int h = 0; h < n; h++) {
+        GLuint v = weld[topo.indices[h]];
+        he.valence[v]++;
+        if (he.twin[h] < 0)
+            he.fan_start[v + 1]++;
+        else
+            closed[v] = h;
+    }
+    for (GLuint v = 0; v < topo.num_verts; v++) {
+        if (he.fan_start[v + 1] == 0 && closed[v] >= 0)
+            he.fan_start[v + 1] = 1;
+        he.fan_start[v + 1] += he.fan_start[v];
+    }
+
+    he.fans.resize(he.fan_start[topo.num_verts]);
+    {
+        vector<GLuint> fill(he.fan_start.begin(), he.fan_start.end() - 1);
+        for (int h = 0; h < n; h++)
+            if (he.twin[h] < 0)
+                he.fans[fill[weld[topo.indices[h]]]++] = h;
+        for (GLuint v = 0; v < topo.num_verts; v++)
+            if (fill[v] < he.fan_start[v + 1])
+                he.fans[fill[v]] = closed[v];
+    }
+
+    return he;
+}
+
+/*
+ * Move every vertex `lambda' of the way towards the average of its
+ * neighbours, reading positions from `in' and writing them to `out'.
+ */
+void
+laplacianSmooth (Topology& topo, HalfEdge& he, WorkerPool& pool,
+        float lambda, vector<float>& in, vector<float>& out)
+{
+    TRACE("laplacianSmooth");
+    auto kernel = [&](int begin, int end) {
+        for (int v = begin; v < end; v++) {
+            float sum[3] = {0, 0, 0};
+            float *p = &in[v * 6];
+            GLuint w = topo.weld[v];
+            int count = 0;
+
+            for (GLuint i = he.fan_start[w]; i < he.fan_start[w + 1]; i++) {
+                int first = he.fans[i], h = first, last;
+                GLuint steps = 0;
+
+                /* a fan can't have more faces than use the vertex */
+                do {
+                    float *q = &in[topo.indices[heNext(h)] * 6];
+                    for (int k = 0; k < 3; k++)
+                        sum[k] += q[k];
+                    count++;
+                    last = h;
+                    h = heRotate(he, h);
+                } while (h >= 0 && h != first && ++steps < he.valence[w]);
+
+                /* an open fan has one more neighbour past its last face */
+                if (h < 0) {
+                    float *q = &in[topo.indices[hePrev(last)] * 6];
+                    for (int k = 0; k < 3; k++)
+                        sum[k] += q[k];
+                    count++;
+                }
+            }
+
+            for (int k = 0; k < 3; k++)
+                out[v * 6 + k] = count ? p[k] + lambda * (sum[k] / count - p[k]) : p[k];
+        }
+    };
+
+    pool.run(topo.num_verts, kernel);
+}
+
+/*
+ * Average the normals of the faces around each vertex. Each vertex gathers
+ * from its own fan so no two threads ever write the same normal.
+ */
+void
+vertexNormals (Topology& topo, HalfEdge& he, WorkerPool& pool,
+        vector<float>& vertices)
+{
+    TRACE("vertexNormals");
+    auto kernel = [&](int begin, int end) {
+        for (int v = begin; v < end; v++) {
+            float *n = &vertices[v * 6 + 3];
+            float norm[3];
+            GLuint w = topo.weld[v];
+
+            n[0] = n[1] = n[2] = 0.f;
+            for (GLuint i = he.fan_start[w]; i < he.fan_start[w + 1]; i++) {
+                int first = he.fans[i], h = first;
+                GLuint steps = 0;
+                do {
+                    int f = h - h % 3;
+                    faceNorm(&vertices[topo.indices[f + 0] * 6],
+                             &vertices[topo.indices[f + 1] * 6],
+                             &vertices[topo.indices[f + 2] * 6], norm);
+                    for (int k = 0; k < 3; k++)
+                        n[k] += norm[k];
+                    h = heRotate(he, h);
+                } while (h >= 0 && h != first && ++steps < he.valence[w]);
+            }
+
+            normalize3f(n);
+        }
+    };
+
+    pool.run(topo.num_verts, kernel);
+}
+
+/*
+ * A subdivided mesh at one depth: its topology and connectivity, which are
+ * built once, and the buffers each frame is evaluated into.
+ */
+struct Mesh {
+    Topology topo;
+    HalfEdge he;
+    vector<float> vertices;     /* interleaved position and normal */
+    vector<float> scratch;      /* other half of the smoothing ping-pong */
+};
+
+void
+buildMesh (BaseMesh& base, int depth, Mesh& mesh)
+{
+    mesh.topo = buildTopology(base, depth);
+    optimizeTopology(mesh.topo);
+    mesh.he = buildHalfEdge(mesh.topo);
+    mesh.vertices.assign(mesh.topo.num_verts * 6, 0.f);
+    mesh.scratch.assign(mesh.topo.num_verts * 6, 0.f);
+}
+
+/* Evaluate the mesh for `percent', smooth it `smooth' times, then light it */
+void
+evolveMesh (Mesh& mesh, WorkerPool& pool, float percent, int smooth)
+{
+    TRACE("evolveMesh");
+    static const float lambda = 0.5f;
+
+    subdivideIco(mesh.topo, percent, mesh.vertices);
+    for (int i = 0; i < smooth; i++) {
+        laplacianSmooth(mesh.topo, mesh.he, pool, lambda,
+                mesh.vertices, mesh.scratch);
+        mesh.vertices.swap(mesh.scratch);
+    }
+    vertexNormals(mesh.topo, mesh.he, pool, mesh.vertices);
+}
+
+float
+clamp (float x, float a, float b)
+{
+	if (x < a) return a;
+	if (x > b) return b;
+	return x;
+}
+
+float
+smoothstep (float edge0, float edge1, float x)
+{
+	float t = clamp((x - edge0) / (edge1 - edge0), 0.0, 1.0);
+	return t * t * (3.0 - 2.0 * t);
+}
+
+/*
+ * Create the shared memory sphere-stat reads. Stats are only for watching,
+ * so if they can't be made, or another sphere which is still running has
+ * them, this warns and returns NULL.
+ */
+Stats*
+openStats ()
+{
+    Stats* stats;
+    int fd;
+
+    fd = shm_open(STATS_SHM_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(Stats)) < 0) {
+        fprintf(stderr, "Warning: no stats at %s: %s\n", STATS_SHM_NAME,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    stats = (Stats*) mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Warning: no stats at %s: %s\n", STATS_SHM_NAME,
+                strerror(errno));
+        return NULL;
+    }
+
+    if (stats->version.load(std::memory_order_acquire) == STATS_VERSION &&
+            stats->pid != (uint32_t) getpid() &&
+            (kill(stats->pid, 0) == 0 || errno == EPERM)) {
+        fprintf(stderr, "Warning: no stats, sphere %u is publishing at %s\n",
+                stats->pid, STATS_SHM_NAME);
+        munmap(stats, sizeof(Stats));
+        return NULL;
+    }
+
+    /*
+     * A previous run may have left its numbers behind, or been killed part
+     * way through a write and left `seq' odd, which readers would wait on
+     * forever. Readers don't attach until the version is back.
+     */
+    StatsSample zero = StatsSample();
+    stats->version.store(0, std::memory_order_relaxed);
+    stats->seq.store(0, std::memory_order_relaxed);
+    statsWrite(stats, zero);
+    stats->pid = getpid();
+    stats->version.store(STATS_VERSION, std::memory_order_release);
+
+    return stats;
+}
+
+void
+closeStats (Stats* stats)
+{
+    if (!stats)
+        return;
+    /* leave the segment to whichever sphere has since taken it over */
+    bool mine = stats->pid == (uint32_t) getpid();
+    munmap(stats, sizeof(Stats));
+    if (mine)
+        shm_unlink(STATS_SHM_NAME);
+}
+
+/* nanoseconds since `start', a performance counter value */
+uint64_t
+nsSince (Uint64 start)
+{
+    static const double freq = SDL_GetPerformanceFrequency();
+    return (SDL_GetPerformanceCounter() - start) * (1e9 / freq);
+}
+
+/* The window, context and GL objects the mesh is drawn with */
+struct Renderer {
+    SDL_Window* window;
+    SDL_GLContext context;
+    GLuint VAO;
+    GLuint VBO;
+    GLuint EBO;
+    Shader shader;
+};
+
+/* Upload all of the mesh's vertices and indices, resizing the buffers */
+void
+uploadMesh (Renderer& r, Mesh& mesh)
+{
+    TRACE("uploadMesh");
+    glBindBuffer(GL_ARRAY_BUFFER, r.VBO);
+    /* reserve size of vertices buffer */
+    glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(float), &mesh.vertices[0], GL_STATIC_DRAW);
+
+    /* triangles index into the shared vertices, this only changes with depth */
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, r.EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.topo.indices.size() * sizeof(GLuint),
+            &mesh.topo.indices[0], GL_STATIC_DRAW);
+}
+
+/*
+ * Open a `width' x `height' window and set up everything needed to draw the
+ * mesh in it, starting with the mesh's current vertices.
+ */
+void
+openRenderer (Renderer& r, Mesh& mesh, int width, int height, Uint32 flags)
+{
+    GLuint vertex_id;
+    GLuint norm_id;
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL Failed to init: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+	SDL_SetHint("SDL_VIDEO_MINIMIZE_ON_FOCUS_LOSS", "0");
+
+	r.window = SDL_CreateWindow("Model",
+		SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+		width, height, flags);
+            //1920, 1080, /* these won't be used if FULLSCREEN is given below */
+            //SDL_WINDOW_OPENGL | SDL_WINDOW_FULLSCREEN_DESKTOP | SDL_WINDOW_BORDERLESS);
+
+    if (!r.window) {
+        fprintf(stderr, "Window could not be created: %s\n", SDL_GetError());
+        SDL_Quit();
+        exit(1);
+    }
+
+    r.context = SDL_GL_CreateContext(r.window);
+    if (!r.context) {
+        printf("Could not create OpenGL context: %s\n", SDL_GetError());
+        SDL_DestroyWindow(r.window);
+        SDL_Quit();
+        exit(1);
+    }
+
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
+            SDL_GL_CONTEXT_PROFILE_CORE);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
+
+#ifdef _WIN32
+    glewInit();
+#endif
+
+    glEnable(GL_DEPTH_TEST);
+
+    glGenVertexArrays(1, &r.VAO);
+    glGenBuffers(1, &r.VBO);
+    glGenBuffers(1, &r.EBO);
+    glBindVertexArray(r.VAO);
+
+    r.shader = Shader(vertex_source, fragment_source);
+    r.shader.use();
+
+    uploadMesh(r, mesh);
 
     /* setup vertices attribute, width of 3 in span of 6 elements */
-    vertex_id = shader.get_attrib_loc("vertex");
+    vertex_id = r.shader.get_attrib_loc("vertex");
     glVertexAttribPointer(vertex_id, 3,
                 GL_FLOAT, GL_FALSE, 6 * sizeof(float), 0);
     glEnableVertexAttribArray(vertex_id);
 
     /* setup normal attribute, width of 3, 3 elements into span of 6 elements */
-    norm_id = shader.get_attrib_loc("norm");
+    norm_id = r.shader.get_attrib_loc("norm");
     glVertexAttribPointer(norm_id, 3, GL_FLOAT,
                 GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
     glEnableVertexAttribArray(norm_id);
 
-    if (SDL_GL_SetSwapInterval(1) < 0)
-        fprintf(stderr, "Warning: SwapInterval could not be set: %s\n",
-                SDL_GetError());
-
     //glEnable(GL_CULL_FACE);
     /* Clockwise winding order are 'face' vertices */
     //glFrontFace(GL_CW);
 
-    bool playing = true;
+    r.shader.set_uniform_3f("objectColor", 1.0f, 0.5f, 0.31f);
+    r.shader.set_uniform_3f("lightColor", 1.0f, 0.5f, 0.31f);
+
+	glLineWidth(2.0f);
+	glEnable(GL_LINE_SMOOTH);
+}
+
+void
+closeRenderer (Renderer& r)
+{
+    r.shader.destroy();
+    glDeleteBuffers(1, &r.EBO);
+    glDeleteBuffers(1, &r.VBO);
+    glDeleteVertexArrays(1, &r.VAO);
+    SDL_GL_DeleteContext(r.context);
+    SDL_DestroyWindow(r.window);
+    SDL_Quit();
+}
+
+/*
+ * Clear and draw the mesh at `pos' as the camera sees it through
+ * `projection', either filled or as a wireframe.
+ */
+void
+drawMesh (Shader& shader, Camera& camera, glm::mat4 projection, Mesh& mesh,
+        glm::vec3 pos, bool solid)
+{
+    glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    shader.set_uniform_mat4fv("projection", projection);
+    shader.set_uniform_3fv("lightPos", camera.pos());
+    shader.set_uniform_mat4fv("view", camera.view());
+
+    glPolygonMode(GL_FRONT_AND_BACK, solid ? GL_FILL : GL_LINE);
+    glm::mat4 model = glm::mat4(1.0f);
+    model = glm::translate(model, pos);
+    //model = glm::rotate(model, 0.25f * time, glm::vec3(0.0, 1.0, 0.0));
+
+    shader.set_uniform_mat4fv("model", model);
+    glDrawElements(GL_TRIANGLES, mesh.topo.indices.size(), GL_UNSIGNED_INT, 0);
+}
+
+/* size of the offscreen frames the benchmark renders and checksums */
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 360
+
+/*
+ * Put the camera where the scripted path has it on frame `f' of `frames'
+ * and return the percent to evolve to. The camera is rebuilt every frame so
+ * any frame can be reproduced on its own: two orbits of the arcball with a
+ * gentle bob in pitch and zoom, while percent sweeps from 0.025 up to 1.
+ */
+float
+scriptFrame (Camera& camera, glm::vec3 pos, int f, int frames)
+{
+    float s = frames > 1 ? (float) f / (frames - 1) : 1.f;
+
+    camera = Camera(camera.screen_x, camera.screen_y, ARCBALL);
+    camera.lookat(pos, 3.f + 0.75f * sinf(2.f * M_PI * s));
+    camera.look((int) (-7200 * s), (int) (250 * sinf(4.f * M_PI * s)));
+
+    return 0.025f + 0.975f * s;
+}
+
+/* FNV-1a over a frame's pixels */
+uint64_t
+frameChecksum (vector<unsigned char>& pixels)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < pixels.size(); i++) {
+        hash ^= pixels[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* nearest-rank percentile of sorted samples */
+double
+percentile (vector<double>& sorted, double p)
+{
+    size_t rank = ceil(p / 100.0 * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/*
+ * Render `frames' scripted frames as fast as possible into an offscreen
+ * framebuffer, checksum each one and print the timings as JSON. Checksums
+ * are compared against `golden' and/or written to `record', one per line.
+ * On a box without a GPU run it under Mesa's llvmpipe, e.g.
+ *
+ *     LIBGL_ALWAYS_SOFTWARE=1 xvfb-run ./sphere -b 600 -g golden.txt
+ *
+ * Returns the exit status: non-zero if any frame didn't match or `golden'
+ * holds a different number of frames.
+ */
+int
+runBenchmark (Renderer& renderer, Mesh& mesh, WorkerPool& pool, Stats* stats,
+        glm::vec3 pos, int frames, const char* golden, const char* record)
+{
+    StatsSample sample = StatsSample();
+    Framebuffer target(BENCH_WIDTH, BENCH_HEIGHT);
+    Camera camera(BENCH_WIDTH, BENCH_HEIGHT, ARCBALL);
+    vector<unsigned long long> expected, sums(frames);
+    vector<double> times(frames);
+    vector<unsigned char> pixels;
+    double freq = SDL_GetPerformanceFrequency();
+    double total = 0;
+    int mismatched = 0;
+    bool wrong_length = false;
+    FILE* file;
+
+    if (golden) {
+        unsigned long long sum;
+        if (!(file = fopen(golden, "r"))) {
+            fprintf(stderr, "Could not read %s: %s\n", golden, strerror(errno));
+            return 1;
+        }
+        while (fscanf(file, "%llx", &sum) == 1)
+            expected.push_back(sum);
+        fclose(file);
+    }
+
+    if (SDL_GL_SetSwapInterval(0) < 0)
+        fprintf(stderr, "Warning: SwapInterval could not be set: %s\n",
+                SDL_GetError());
+
+    target.bind();
+    for (int f = 0; f < frames; f++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        float percent = scriptFrame(camera, pos, f, frames);
+
+        evolveMesh(mesh, pool, percent, 0);
+        sample.regen_ns = nsSince(start);
+        {
+            TRACE("upload");
+            glBufferSubData(GL_ARRAY_BUFFER, 0, mesh.vertices.size() * sizeof(float), &mesh.vertices[0]);
+        }
+        {
+            TRACE("draw");
+            drawMesh(renderer.shader, camera, camera.projection(), mesh, pos, false);
+            target.blit(BENCH_WIDTH, BENCH_HEIGHT);
+        }
+        {
+            TRACE("swap");
+            SDL_GL_SwapWindow(renderer.window);
+            glFinish();
+        }
+
+        times[f] = (SDL_GetPerformanceCounter() - start) / freq * 1000.0;
+        total += times[f];
+
+        sample.frames++;
+        sample.frame_ns = times[f] * 1e6;
+        sample.upload_bytes += mesh.vertices.size() * sizeof(float);
+        sample.triangles += mesh.topo.indices.size() / 3;
+        if (stats)
+            statsWrite(stats, sample);
+
+        /* reading back stalls the pipeline, so it's left out of the timing */
+        {
+            TRACE("readback");
+            target.read(pixels);
+        }
+        sums[f] = frameChecksum(pixels);
+        if (golden && ((size_t) f >= expected.size() || expected[f] != sums[f])) {
+            if (mismatched++ == 0)
+                fprintf(stderr, "frame %d checksum %016llx doesn't match golden\n",
+                        f, sums[f]);
+        }
+    }
+    target.destroy();
+
+    /* a golden run of a different length is from a different script */
+    if (golden && expected.size() != (size_t) frames) {
+        fprintf(stderr, "%s has %lu checksums for %d frames\n", golden,
+                expected.size(), frames);
+        wrong_length = true;
+    }
+
+    if (record) {
+        if (!(file = fopen(record, "w"))) {
+            fprintf(stderr, "Could not write %s: %s\n", record, strerror(errno));
+            return 1;
+        }
+        for (int f = 0; f < frames; f++)
+            fprintf(file, "%016llx\n", sums[f]);
+        fclose(file);
+    }
+
+    std::sort(times.begin(), times.end());
+    printf("{\n");
+    printf("  \"renderer\": \"%s\",\n", (const char*) glGetString(GL_RENDERER));
+    printf("  \"width\": %d,\n", BENCH_WIDTH);
+    printf("  \"height\": %d,\n", BENCH_HEIGHT);
+    printf("  \"depth\": %d,\n", mesh.topo.depth);
+    printf("  \"triangles\": %lu,\n", mesh.topo.indices.size() / 3);
+    printf("  \"frames\": %d,\n", frames);
+    printf("  \"frame_ms\": { \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+            "\"p99\": %.3f, \"max\": %.3f },\n", total / frames,
+            percentile(times, 50), percentile(times, 90),
+            percentile(times, 99), times[frames - 1]);
+    printf("  \"fps\": %.2f,\n", frames / (total / 1000.0));
+    printf("  \"triangles_per_sec\": %.0f,\n",
+            frames * (mesh.topo.indices.size() / 3) / (total / 1000.0));
+    printf("  \"golden\": \"%s\",\n", !golden ? "unchecked"
+            : mismatched || wrong_length ? "mismatch" : "match");
+    printf("  \"mismatched_frames\": %d\n", mismatched);
+    printf("}\n");
+
+    return mismatched || wrong_length ? 1 : 0;
+}
+
+/*
+ * Shared between the tiled render coordinator and its workers, followed by
+ * a start semaphore per worker and then two RGB frames, so workers can fill
+ * one while the coordinator writes out the other.
+ */
+struct TiledShared {
+    sem_t done;             /* posted by each worker when its tiles are in */
+};
+
+/*
+ * Pixels drawn around each tile and cropped off again. GL clips a wide line
+ * by its centre, so without them lines just outside a tile would lose the
+ * part of their width which falls inside it. At least glLineWidth + 1.
+ */
+#define TILE_GUARD 3
+
+/*
+ * Render this worker's share of the tiles for every frame. Each frame waits
+ * for the coordinator's go-ahead and is evolved on the same fixed timestep
+ * as every other worker, so their tiles line up.
+ */
+void
+tileWorker (TiledShared* shared, sem_t* start, unsigned char** images,
+        Mesh& mesh, glm::vec3 pos, int width, int height,
+        int tiles_x, int tiles_y, int worker, int workers, int frames)
+{
+    int tile_w = (width + tiles_x - 1) / tiles_x;
+    int tile_h = (height + tiles_y - 1) / tiles_y;
+    Camera camera(width, height, ARCBALL);
+    vector<unsigned char> pixels;
+    WorkerPool pool(0);
+    Renderer renderer;
+
+    int band_w = tile_w + 2 * TILE_GUARD;
+    int band_h = tile_h + 2 * TILE_GUARD;
+
+    openRenderer(renderer, mesh, band_w, band_h,
+            SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    Framebuffer target(band_w, band_h);
+
+    for (int f = 0; f < frames; f++) {
+        unsigned char* image = images[f % 2];
+
+        while (sem_wait(&start[worker]) < 0 && errno == EINTR)
+            ;
+
+        float percent = scriptFrame(camera, pos, f, frames);
+        evolveMesh(mesh, pool, percent, 0);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, mesh.vertices.size() * sizeof(float), &mesh.vertices[0]);
+
+        for (int t = worker; t < tiles_x * tiles_y; t += workers) {
+            /* tiles count down from the top, GL counts up from the bottom */
+            int x = (t % tiles_x) * tile_w;
+            int top = (t / tiles_x) * tile_h;
+            int w = std::min(tile_w, width - x);
+            int h = std::min(tile_h, height - top);
+            int y = height - top - h;
+
+            if (w <= 0 || h <= 0)
+                continue;
+
+            target.bind();
+            glViewport(0, 0, w + 2 * TILE_GUARD, h + 2 * TILE_GUARD);
+            drawMesh(renderer.shader, camera,
+                    camera.projection(x - TILE_GUARD, y - TILE_GUARD,
+                        w + 2 * TILE_GUARD, h + 2 * TILE_GUARD),
+                    mesh, pos, false);
+            target.read(pixels);
+
+            /* crop the guard band back off */
+            for (int row = 0; row < h; row++) {
+                unsigned char* src = &pixels[((h - 1 - row + TILE_GUARD) * band_w
+                        + TILE_GUARD) * 4];
+                unsigned char* dst = &image[((top + row) * width + x) * 3];
+                for (int i = 0; i < w; i++) {
+                    dst[i * 3 + 0] = src[i * 4 + 0];
+                    dst[i * 3 + 1] = src[i * 4 + 1];
+                    dst[i * 3 + 2] = src[i * 4 + 2];
+                }
+            }
+        }
+
+        sem_post(&shared->done);
+    }
+
+    target.destroy();
+    closeRenderer(renderer);
+}
+
+/* Write an RGB image, top row first, as the PPM named by `output' for frame `f' */
+bool
+writeFrame (const char* output, int f, unsigned char* image, int width, int height)
+{
+    char path[4096];
+    FILE* file;
+
+    snprintf(path, sizeof(path), output, f);
+    if (!(file = fopen(path, "wb"))) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    fwrite(image, 1, (size_t) width * height * 3, file);
+    fclose(file);
+    fprintf(stderr, "wrote %s\n", path);
+    return true;
+}
+
+/*
+ * Render `frames' frames of `width' x `height' split into tiles_x x tiles_y
+ * tiles, spread over `workers' processes which each have their own GL
+ * context. Every frame is assembled in shared memory and written out as a
+ * PPM named by the printf pattern `output'. Returns the exit status.
+ */
+int
+runTiled (Mesh& mesh, glm::vec3 pos, int width, int height,
+        int tiles_x, int tiles_y, int workers, int frames, const char* output)
+{
+    size_t frame_size = (size_t) width * height * 3;
+    size_t size = sizeof(TiledShared) + workers * sizeof(sem_t) + 2 * frame_size;
+    vector<pid_t> pids;
+    TiledShared* shared;
+    unsigned char* images[2];
+    sem_t* start;
+    int status = 0;
+
+    if (width <= 0 || height <= 0 || tiles_x <= 0 || tiles_y <= 0 ||
+            workers <= 0) {
+        fprintf(stderr, "Tiled rendering needs -s WxH, -t COLSxROWS and -j > 0\n");
+        return 1;
+    }
+    workers = std::min(workers, tiles_x * tiles_y);
+
+    shared = (TiledShared*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Could not map %lu bytes for frames: %s\n", size,
+                strerror(errno));
+        return 1;
+    }
+    start = (sem_t*) (shared + 1);
+    images[0] = (unsigned char*) (start + workers);
+    images[1] = images[0] + frame_size;
+
+    sem_init(&shared->done, 1, 0);
+    for (int w = 0; w < workers; w++)
+        sem_init(&start[w], 1, 0);
+
+    /*
+     * The mesh is already built, so workers get it copy-on-write. Anything
+     * buffered is flushed first so children don't write it out again.
+     */
+    fflush(NULL);
+    for (int w = 0; w < workers; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            tileWorker(shared, start, images, mesh, pos, width, height,
+                    tiles_x, tiles_y, w, workers, frames);
+            _exit(0);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "Could not start worker: %s\n", strerror(errno));
+            status = 1;
+            frames = 0;
+            break;
+        }
+        pids.push_back(pid);
+    }
+
+    if (frames > 0)
+        for (int w = 0; w < workers; w++)
+            sem_post(&start[w]);
+
+    for (int f = 0; f < frames && status == 0; f++) {
+        /* wait for every worker, giving up if one of them has died */
+        for (int done = 0; done < workers && status == 0; ) {
+            struct timespec deadline;
+            int wstatus;
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            if (sem_timedwait(&shared->done, &deadline) == 0) {
+                done++;
+                continue;
+            }
+            for (size_t i = 0; i < pids.size(); i++) {
+                if (pids[i] > 0 && waitpid(pids[i], &wstatus, WNOHANG) == pids[i]) {
+                    fprintf(stderr, "Tile worker %lu exited during frame %d\n", i, f);
+                    pids[i] = 0;
+                    status = 1;
+                }
+            }
+        }
+        if (status != 0)
+            break;
+
+        /* workers start the next frame in the other image while this one is written */
+        if (f + 1 < frames)
+            for (int w = 0; w < workers; w++)
+                sem_post(&start[w]);
+
+        if (!writeFrame(output, f, images[f % 2], width, height)) {
+            status = 1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < pids.size(); i++) {
+        if (pids[i] <= 0)
+            continue;
+        if (status != 0)
+            kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+
+    for (int w = 0; w < workers; w++)
+        sem_destroy(&start[w]);
+    sem_destroy(&shared->done);
+    munmap(shared, size);
+
+    return status;
+}
+
+/* side of the square screen tiles the CPU rasterizer bins into */
+#define RASTER_TILE 64
+/* the same as glLineWidth in openRenderer */
+#define RASTER_LINE_WIDTH 2.f
+
+/*
+ * A frame rasterized on the CPU, for boxes without a GL context. Vertices
+ * are transformed and lit once, each edge or triangle is binned into the
+ * screen tiles it touches, then the tiles are drawn in parallel with a depth
+ * buffer each, so no two threads ever touch the same pixel.
+ */
+struct Raster {
+    int width;
+    int height;
+    int tiles_x;
+    int tiles_y;
+    vector<unsigned char> image;    /* RGB, top row first */
+    vector<float> screen;           /* per vertex x, y in pixels and depth */
+    vector<float> color;            /* per vertex lit RGB */
+    vector<int> bin_start;          /* per tile, its first entry in `bins' */
+    vector<int> bins;               /* edges or triangles touching each tile */
+};
+
+/*
+ * Transform and light every vertex the way the shaders do. A vertex behind
+ * the eye gets a negative depth and whatever uses it is skipped, the
+ * camera never gets close enough for that to need clipping.
+ */
+void
+rasterTransform (Raster& r, Mesh& mesh, WorkerPool& pool, glm::mat4 model,
+        glm::mat4 view, glm::mat4 projection, glm::vec3 light)
+{
+    TRACE("rasterTransform");
+    /* lightColor times objectColor */
+    static const float tint[3] = { 1.0f, 0.5f * 0.5f, 0.31f * 0.31f };
+    glm::mat4 mvp = projection * view * model;
+    float* v = &mesh.vertices[0];
+
+    r.screen.resize(mesh.topo.num_verts * 3);
+    r.color.resize(mesh.topo.num_verts * 3);
+
+    auto kernel = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            glm::vec4 p(v[i * 6 + 0], v[i * 6 + 1], v[i * 6 + 2], 1.0f);
+            glm::vec4 clip = mvp * p;
+            glm::vec3 frag = glm::vec3(model * p);
+            glm::vec3 norm = glm::normalize(
+                    glm::vec3(v[i * 6 + 3], v[i * 6 + 4], v[i * 6 + 5]));
+            float diff = std::max(glm::dot(norm, glm::normalize(light - frag)), 0.0f);
+
+            for (int c = 0; c < 3; c++)
+                r.color[i * 3 + c] = std::min((0.25f + diff) * tint[c], 1.0f);
+
+            if (clip.w <= 0) {
+                r.screen[i * 3 + 2] = -1;
+                continue;
+            }
+            r.screen[i * 3 + 0] = (0.5f + 0.5f * clip.x / clip.w) * r.width;
+            r.screen[i * 3 + 1] = (0.5f - 0.5f * clip.y / clip.w) * r.height;
+            r.screen[i * 3 + 2] = 0.5f + 0.5f * clip.z / clip.w;
+        }
+    };
+    pool.run(mesh.topo.num_verts, kernel);
+}
+
+/*
+ * The vertices of triangle `p', or of half-edge `p' as a line. An edge is
+ * only drawn from the lower of its two half-edges, so none is returned for
+ * the other, unless they join different copies of midpoints which haven't
+ * met yet.
+ */
+int
+rasterVerts (Mesh& mesh, bool solid, int p, GLuint* v)
+{
+    vector<GLuint>& indices = mesh.topo.indices;
+
+    if (solid) {
+        v[0] = indices[p * 3 + 0];
+        v[1] = indices[p * 3 + 1];
+        v[2] = indices[p * 3 + 2];
+        return 3;
+    }
+    v[0] = indices[p];
+    v[1] = indices[heNext(p)];
+    int t = mesh.he.twin[p];
+    if (t >= 0 && t < p && indices[t] == v[1] && indices[heNext(t)] == v[0])
+        return 0;
+    return 2;
+}
+
+/*
+ * Bin the edges or triangles into the tiles their bounds overlap, counted
+ * then filled like the OBJ loader. It goes in order so every tile draws the
+ * same primitives in the same order each run.
+ */
+void
+rasterBin (Raster& r, Mesh& mesh, bool solid)
+{
+    TRACE("rasterBin");
+    int count = solid ? mesh.topo.indices.size() / 3 : mesh.topo.indices.size();
+    int tiles = r.tiles_x * r.tiles_y;
+    float pad = solid ? 0 : RASTER_LINE_WIDTH + 1;
+    vector<int> rect(count * 4);
+    vector<int> cursor;
+
+    r.bin_start.assign(tiles + 1, 0);
+    for (int p = 0; p < count; p++) {
+        int* t = &rect[p * 4];
+        float lo[2] = { FLT_MAX, FLT_MAX }, hi[2] = { -FLT_MAX, -FLT_MAX };
+        GLuint v[3];
+        int n = rasterVerts(mesh, solid, p, v);
+        bool behind = false;
+
+        /* empty unless it is on screen */
+        t[0] = t[1] = 0;
+        t[2] = t[3] = -1;
+
+        for (int i = 0; i < n; i++) {
+            float* s = &r.screen[v[i] * 3];
+            behind |= s[2] < 0;
+            for (int a = 0; a < 2; a++) {
+                lo[a] = std::min(lo[a], s[a] - pad);
+                hi[a] = std::max(hi[a], s[a] + pad);
+            }
+        }
+        if (n == 0 || behind || hi[0] < 0 || hi[1] < 0 ||
+                lo[0] >= r.width || lo[1] >= r.height)
+            continue;
+
+        t[0] = (int) std::max(lo[0], 0.0f) / RASTER_TILE;
+        t[1] = (int) std::max(lo[1], 0.0f) / RASTER_TILE;
+        t[2] = (int) std::min(hi[0], r.width - 1.0f) / RASTER_TILE;
+        t[3] = (int) std::min(hi[1], r.height - 1.0f) / RASTER_TILE;
+        for (int y = t[1]; y <= t[3]; y++)
+            for (int x = t[0]; x <= t[2]; x++)
+                r.bin_start[y * r.tiles_x + x + 1]++;
+    }
+
+    for (int i = 0; i < tiles; i++)
+        r.bin_start[i + 1] += r.bin_start[i];
+    r.bins.resize(r.bin_start[tiles]);
+    cursor.assign(r.bin_start.begin(), r.bin_start.end() - 1);
+
+    for (int p = 0; p < count; p++) {
+        int* t = &rect[p * 4];
+        for (int y = t[1]; y <= t[3]; y++)
+            for (int x = t[0]; x <= t[2]; x++)
+                r.bins[cursor[y * r.tiles_x + x]++] = p;
+    }
+}
+
+/* Depth tested blend of `color' over the `cover' of the pixel at x, y */
+inline void
+rasterPixel (Raster& r, float* depth, int x0, int y0, int x, int y, float z,
+        float* color, float cover)
+{
+    float& d = depth[(y - y0) * RASTER_TILE + (x - x0)];
+    unsigned char* px = &r.image[((size_t) y * r.width + x) * 3];
+
+    if (z >= d)
+        return;
+    d = z;
+    for (int c = 0; c < 3; c++)
+        px[c] = (unsigned char) (px[c] + (color[c] * 255.f - px[c]) * cover + 0.5f);
+}
+
+/*
+ * Draw the part of the line from vertex `a' to `b' inside the tile. This is
+ * Wu's line widened: step along the major axis a pixel at a time and cover
+ * the pixels across it in proportion to how much of the line's span is in
+ * each, with the span stretched by the slope to keep the width even.
+ */
+void
+rasterLine (Raster& r, float* depth, int x0, int y0, int x1, int y1,
+        GLuint a, GLuint b)
+{
+    float* p = &r.screen[a * 3];
+    float* q = &r.screen[b * 3];
+    float* cp = &r.color[a * 3];
+    float* cq = &r.color[b * 3];
+    bool steep = fabsf(q[1] - p[1]) > fabsf(q[0] - p[0]);
+    int u = steep ? 1 : 0;      /* major axis */
+    int w = 1 - u;              /* minor axis */
+    int lo[2] = { x0, y0 }, hi[2] = { x1, y1 };
+
+    if (p[u] > q[u]) {
+        std::swap(p, q);
+        std::swap(cp, cq);
+    }
+
+    float length = q[u] - p[u];
+    float slope = length > 0 ? (q[w] - p[w]) / length : 0;
+    float half = RASTER_LINE_WIDTH / 2 * sqrtf(1 + slope * slope);
+    int first = std::max((float) lo[u], ceilf(p[u] - 0.5f));
+    int last = std::min(hi[u] - 1.0f, floorf(q[u] - 0.5f));
+
+    for (int i = first; i <= last; i++) {
+        float t = length > 0 ? (i + 0.5f - p[u]) / length : 0;
+        float centre = p[w] + (q[w] - p[w]) * t;
+        float z = p[2] + (q[2] - p[2]) * t;
+        float color[3];
+        int begin = std::max((float) lo[w], floorf(centre - half));
+        int end = std::min(hi[w] - 1.0f, floorf(centre + half));
+
+        for (int c = 0; c < 3; c++)
+            color[c] = cp[c] + (cq[c] - cp[c]) * t;
+
+        for (int j = begin; j <= end; j++) {
+            float cover = std::min(j + 1.0f, centre + half)
+                - std::max((float) j, centre - half);
+            if (cover <= 0)
+                continue;
+            if (steep)
+                rasterPixel(r, depth, x0, y0, j, i, z, color, cover);
+            else
+                rasterPixel(r, depth, x0, y0, i, j, z, color, cover);
+        }
+    }
+}
+
+/* Twice the signed area of a, b and the point x, y */
+inline float
+rasterEdge (float* a, float* b, float x, float y)
+{
+    return (b[0] - a[0]) * (y - a[1]) - (b[1] - a[1]) * (x - a[0]);
+}
+
+/*
+ * Fill the part of the triangle inside the tile, sampling at pixel centres,
+ * in one colour: the mean of its lit corners.
+ */
+void
+rasterTriangle (Raster& r, float* depth, int x0, int y0, int x1, int y1,
+        GLuint* v)
+{
+    float* a = &r.screen[v[0] * 3];
+    float* b = &r.screen[v[1] * 3];
+    float* c = &r.screen[v[2] * 3];
+    float area = rasterEdge(a, b, c[0], c[1]);
+    float color[3];
+
+    if (area == 0)
+        return;
+
+    for (int i = 0; i < 3; i++)
+        color[i] = (r.color[v[0] * 3 + i] + r.color[v[1] * 3 + i]
+                + r.color[v[2] * 3 + i]) / 3;
+
+    /* clamped before converting, a vertex near the eye can be far off screen */
+    int left = std::max((float) x0, floorf(std::min(a[0], std::min(b[0], c[0]))));
+    int right = std::min(x1 - 1.0f, ceilf(std::max(a[0], std::max(b[0], c[0]))));
+    int top = std::max((float) y0, floorf(std::min(a[1], std::min(b[1], c[1]))));
+    int bottom = std::min(y1 - 1.0f, ceilf(std::max(a[1], std::max(b[1], c[1]))));
+
+    for (int y = top; y <= bottom; y++) {
+        for (int x = left; x <= right; x++) {
+            /* barycentric weights, whichever way round the triangle winds */
+            float wa = rasterEdge(b, c, x + 0.5f, y + 0.5f) / area;
+            float wb = rasterEdge(c, a, x + 0.5f, y + 0.5f) / area;
+            float wc = 1 - wa - wb;
+            if (wa < 0 || wb < 0 || wc < 0)
+                continue;
+            rasterPixel(r, depth, x0, y0, x, y,
+                    wa * a[2] + wb * b[2] + wc * c[2], color, 1);
+        }
+    }
+}
+
+/* Clear tile `t' and draw everything binned into it */
+void
+rasterTile (Raster& r, Mesh& mesh, bool solid, int t)
+{
+    static const unsigned char background[3] = { 51, 77, 77 };
+    float depth[RASTER_TILE * RASTER_TILE];
+    int x0 = (t % r.tiles_x) * RASTER_TILE;
+    int y0 = (t / r.tiles_x) * RASTER_TILE;
+    int x1 = std::min(x0 + RASTER_TILE, r.width);
+    int y1 = std::min(y0 + RASTER_TILE, r.height);
+    GLuint v[3];
+
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            memcpy(&r.image[((size_t) y * r.width + x) * 3], background, 3);
+            depth[(y - y0) * RASTER_TILE + (x - x0)] = 1.0f;
+        }
+    }
+
+    for (int i = r.bin_start[t]; i < r.bin_start[t + 1]; i++) {
+        int n = rasterVerts(mesh, solid, r.bins[i], v);
+        if (n == 3)
+            rasterTriangle(r, depth, x0, y0, x1, y1, v);
+        else if (n == 2)
+            rasterLine(r, depth, x0, y0, x1, y1, v[0], v[1]);
+    }
+}
+
+/* The CPU's drawMesh, into r.image */
+void
+rasterFrame (Raster& r, Mesh& mesh, WorkerPool& pool, Camera& camera,
+        glm::vec3 pos, bool solid)
+{
+    TRACE("rasterFrame");
+    glm::vec3 light = camera.pos();
+    glm::mat4 view = camera.view();
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), pos);
+
+    rasterTransform(r, mesh, pool, model, view, camera.projection(), light);
+    rasterBin(r, mesh, solid);
+
+    auto kernel = [&](int begin, int end) {
+        for (int t = begin; t < end; t++)
+            rasterTile(r, mesh, solid, t);
+    };
+    pool.run(r.tiles_x * r.tiles_y, kernel, 1);
+}
+
+/*
+ * Render `frames' scripted frames of `width' x `height' on the CPU and
+ * write them out as PPMs named by the printf pattern `output'. Needs
+ * neither a display nor GL. Returns the exit status.
+ */
+int
+runRaster (Mesh& mesh, WorkerPool& pool, glm::vec3 pos, int width, int height,
+        int frames, const char* output, bool solid)
+{
+    Camera camera(width, height, ARCBALL);
+    Raster r;
+
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "CPU rendering needs -s WxH\n");
+        return 1;
+    }
+    r.width = width;
+    r.height = height;
+    r.tiles_x = (width + RASTER_TILE - 1) / RASTER_TILE;
+    r.tiles_y = (height + RASTER_TILE - 1) / RASTER_TILE;
+    r.image.resize((size_t) width * height * 3);
+
+    for (int f = 0; f < frames; f++) {
+        auto start = chrono::steady_clock::now();
+        float percent = scriptFrame(camera, pos, f, frames);
+
+        evolveMesh(mesh, pool, percent, 0);
+        rasterFrame(r, mesh, pool, camera, pos, solid);
+        fprintf(stderr, "frame %d rendered in %.1fms\n", f,
+                chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+        if (!writeFrame(output, f, &r.image[0], width, height))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * sphere [options] [mesh.obj | mesh.ply]
+ *
+ *   -d depth      subdivision depth, 3 by default
+ *   -B ms         govern depth to keep each frame's work under a budget
+ *   -M            let the governor switch between solid and wireframe too
+ *   -f            draw filled, in the window and with -c; -b and -t always
+ *                 draw wireframe
+ *   -T file       record a Chrome trace, written on `t' and at exit
+ *   -b frames     run the offscreen benchmark, checked against -g golden
+ *                 and/or recorded to -r file
+ *   -t CxR        render tiled frames over -j worker processes, 7680x4320
+ *                 unless -s is given
+ *   -c            render frames on the CPU, needs -s
+ *   -s WxH        frame size for -t and -c
+ *   -n frames     how many frames -t and -c render, 1 by default
+ *   -o pattern    printf pattern naming the frames, frame%04d.ppm by default
+ *
+ * To catch rendering regressions, record checksums once from a build known
+ * to be good, then check every later build against them with the same
+ * frame count and depth, on the same GL implementation:
+ *
+ *     ./sphere -b 600 -r golden.txt
+ *     ./sphere -b 600 -g golden.txt
+ *
+ * The check exits non-zero if any frame differs or the counts don't match.
+ */
+int
+main(int argc, char** argv)
+{
+    SDL_Event e;
+    SDL_DisplayMode display;
+
+    const char* mesh_path = NULL;
+    const char* golden = NULL;
+    const char* record = NULL;
+    const char* output = "frame%04d.ppm";
+    const char* trace = NULL;
+    int depth = 3;
+    int bench = 0;
+    int tiles_x = 0, tiles_y = 0;
+    int width = 0, height = 0;
+    int workers = std::max(1u, thread::hardware_concurrency());
+    int frames = 1;
+    float budget = 0;
+    bool switch_mode = false;
+    bool cpu = false;
+    bool fill = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i + 1 < argc)
+            depth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            bench = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+            golden = argv[++i];
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            record = argv[++i];
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            char extra;
+            if (sscanf(argv[++i], "%dx%d%c", &tiles_x, &tiles_y, &extra) != 2
+                    || tiles_x <= 0 || tiles_y <= 0) {
+                fprintf(stderr, "-t needs COLSxROWS, both 1 or more\n");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            sscanf(argv[++i], "%dx%d", &width, &height);
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "-B") && i + 1 < argc)
+            budget = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-M"))
+            switch_mode = true;
+        else if (!strcmp(argv[i], "-T") && i + 1 < argc)
+            trace = argv[++i];
+        else if (!strcmp(argv[i], "-c"))
+            cpu = true;
+        else if (!strcmp(argv[i], "-f"))
+            fill = true;
+        else
+            mesh_path = argv[i];
+    }
+
+    if (depth < 0) {
+        fprintf(stderr, "Depth must be 0 or more\n");
+        return 1;
+    }
+
+    /* written out on `t' and at exit */
+    traceName("main");
+    if (trace)
+        traceStart(trace);
+
+    /*
+     * The render thread works too, so leave it a core. Tiled rendering
+     * forks, which is only safe before there are any other threads, and
+     * its workers are processes anyway.
+     */
+    WorkerPool pool(tiles_x > 0 ? 0 : std::max(1u, thread::hardware_concurrency()) - 1);
+    int smooth = 0;
+
+    /* only the window and benchmark are worth watching live */
+    Stats* stats = tiles_x > 0 || cpu ? NULL : openStats();
+    StatsSample sample = StatsSample();
+
+    BaseMesh base;
+    if (mesh_path)
+        loadMesh(mesh_path, pool, base);
+    else
+        base = buildIco();
+
+    /* the governor moves between depths, so keep each one it has built */
+    Governor governor;
+    if (budget > 0) {
+        governor = Governor(budget, depth, switch_mode);
+        depth = governor.depth;
+    }
+    governor.solid = fill;
+
+    map<int, Mesh> meshes;
+    Mesh* mesh = &meshes[depth];
+    buildMesh(base, depth, *mesh);
+    evolveMesh(*mesh, pool, 1.0, smooth);
 
     glm::vec3 pos(0, 0, 0);
 
-	camera.lookat(pos, 3);
+    if (tiles_x > 0) {
+        if (width == 0 && height == 0) {
+            width = 7680;
+            height = 4320;
+        }
+        return runTiled(*mesh, pos, width, height, tiles_x, tiles_y,
+                workers, frames, output);
+    }
+
+    if (cpu) {
+        return runRaster(*mesh, pool, pos, width, height, frames,
+                output, fill);
+    }
+
+    Renderer renderer;
+    openRenderer(renderer, *mesh, 1280, 720,
+            SDL_WINDOW_OPENGL | (bench ? SDL_WINDOW_HIDDEN : 0));
+
+    /* Get screen width and height since we're in fullscreen */
+    SDL_GetCurrentDisplayMode(0, &display);
+    Camera camera(display.w, display.h, ARCBALL);
+    Shader& shader = renderer.shader;
+
+    if (bench > 0) {
+        int status = runBenchmark(renderer, *mesh, pool, stats, pos,
+                bench, golden, record);
+        closeStats(stats);
+        closeRenderer(renderer);
+        return status;
+    }
+
+    if (SDL_GL_SetSwapInterval(1) < 0)
+        fprintf(stderr, "Warning: SwapInterval could not be set: %s\n",
+                SDL_GetError());
+
+    bool playing = true;
 
-    shader.set_uniform_3f("objectColor", 1.0f, 0.5f, 0.31f);
-    shader.set_uniform_3f("lightColor", 1.0f, 0.5f, 0.31f);
+	camera.lookat(pos, 3);
 
 	float last = 0;
     float time = 0;
@@ -784,12 +3347,15 @@ main(int argc, char** argv)
     float percent = 0;
 	bool hold = false;
 
-	glLineWidth(2.0f);
-	glEnable(GL_LINE_SMOOTH);
-
 	float t = 0;
 
+    /* frames taking over one and a half refreshes count as dropped */
+    uint64_t refresh_ns = 1e9 / (display.refresh_rate > 0 ? display.refresh_rate : 60);
+    Uint64 frame_start = SDL_GetPerformanceCounter();
+    uint64_t upload_ns = 0;
+
     while (playing) {
+        TRACE("frame");
         while (SDL_PollEvent(&e)) {
             switch (e.type) {
                 case SDL_QUIT:
@@ -800,6 +3366,14 @@ main(int argc, char** argv)
                         case SDLK_ESCAPE:
                             playing = false;
                             break;
+                        case SDLK_s:
+                            smooth = (smooth + 1) % 4;
+                            fprintf(stderr, "smoothing %d times\n", smooth);
+                            break;
+                        case SDLK_t:
+                            if (trace && traceWrite())
+                                fprintf(stderr, "trace written to %s\n", trace);
+                            break;
                     }
                     break;
             }
@@ -810,13 +3384,22 @@ main(int argc, char** argv)
 		last = time;
         shader.set_uniform_1f("time", time);
 
+		sample.regen_ns = 0;
 		if (!hold) {
 			t += delta;
 			percent = (cos(0.25 * t) + 1.0) / 2.0;
 			if (percent < 0.025)
 				percent = 0.025;
-			vertices = subdivideIco(ico, 3, percent);
-			glBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size() * sizeof(float), &vertices[0]);
+			Uint64 regen_start = SDL_GetPerformanceCounter();
+			evolveMesh(*mesh, pool, percent, smooth);
+			sample.regen_ns = nsSince(regen_start);
+			Uint64 upload_start = SDL_GetPerformanceCounter();
+			{
+				TRACE("upload");
+				glBufferSubData(GL_ARRAY_BUFFER, 0, mesh->vertices.size() * sizeof(float), &mesh->vertices[0]);
+			}
+			upload_ns = nsSince(upload_start);
+			sample.upload_bytes += mesh->vertices.size() * sizeof(float);
 
 			if (percent >= 0.99 && time > delay) {
 				hold = true;
@@ -828,26 +3411,50 @@ main(int argc, char** argv)
 			delay = time + 1.0f;
 		}
 
-        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
 		camera.look(-1, 0);
+        Uint64 draw_start = SDL_GetPerformanceCounter();
+        {
+            TRACE("draw");
+            drawMesh(shader, camera, camera.projection(), *mesh, pos, governor.solid);
+        }
 
-		shader.set_uniform_mat4fv("projection", camera.projection());
-		shader.set_uniform_3fv("lightPos", camera.pos());
-		shader.set_uniform_mat4fv("view", camera.view());
-
-        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        //glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::translate(model, pos);
-		//model = glm::rotate(model, 0.25f * time, glm::vec3(0.0, 1.0, 0.0));
+        /* draws are queued, so the governor has to wait to see what they cost */
+        if (governor.enabled && !hold) {
+            {
+                TRACE("finish");
+                glFinish();
+            }
+            if (governor.update(sample.regen_ns / 1e6, upload_ns / 1e6,
+                        nsSince(draw_start) / 1e6) &&
+                    governor.depth != mesh->topo.depth) {
+                Uint64 build_start = SDL_GetPerformanceCounter();
+                mesh = &meshes[governor.depth];
+                if (mesh->topo.indices.empty())
+                    buildMesh(base, governor.depth, *mesh);
+                evolveMesh(*mesh, pool, percent, smooth);
+                uploadMesh(renderer, *mesh);
+                fprintf(stderr, "governor: depth %d ready in %.1fms\n",
+                        governor.depth, nsSince(build_start) / 1e6);
+            }
+        }
 
-        shader.set_uniform_mat4fv("model", model);
-        glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+        {
+            TRACE("swap");
+            SDL_GL_SwapWindow(renderer.window);
+        }
 
-        SDL_GL_SwapWindow(window);
+        sample.frames++;
+        sample.frame_ns = nsSince(frame_start);
+        sample.triangles += mesh->topo.indices.size() / 3;
+        if (sample.frame_ns > refresh_ns * 3 / 2)
+            sample.dropped_frames++;
+        if (stats)
+            statsWrite(stats, sample);
+        frame_start = SDL_GetPerformanceCounter();
     }
 
+    closeStats(stats);
+    closeRenderer(renderer);
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+#ifndef SPHERE_STATS_H
+#define SPHERE_STATS_H
+
+#include <atomic>
+#include <stdint.h>
+
+/* name of the shared memory segment the sphere publishes its stats in */
+#define STATS_SHM_NAME "/sphere-stats"
+#define STATS_VERSION 1
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+        "stats are shared between processes so must be lock-free");
+
+/* A consistent copy of the stats, taken by statsRead */
+struct StatsSample {
+    uint64_t frames;
+    uint64_t frame_ns;          /* length of the last frame */
+    uint64_t regen_ns;          /* evolving the mesh in the last frame */
+    uint64_t upload_bytes;      /* total vertex data uploaded */
+    uint64_t triangles;         /* total triangles drawn */
+    uint64_t dropped_frames;    /* frames longer than 1.5 refresh intervals */
+};
+
+/*
+ * Live counters the sphere publishes for sphere-stat, protected by a
+ * seqlock. The writer makes `seq' odd while it updates and even again
+ * after, and a reader retries whenever `seq' was odd or has moved. Neither
+ * side ever blocks the other or makes a syscall.
+ */
+struct Stats {
+    std::atomic<uint32_t> version;  /* set last, once the rest is ready */
+    uint32_t pid;
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> frame_ns;
+    std::atomic<uint64_t> regen_ns;
+    std::atomic<uint64_t> upload_bytes;
+    std::atomic<uint64_t> triangles;
+    std::atomic<uint64_t> dropped_frames;
+};
+
+/* Only the sphere itself writes, so the sequence needs no read-modify-write */
+inline void
+statsWrite (Stats* s, StatsSample& v)
+{
+    uint32_t seq = s->seq.load(std::memory_order_relaxed);
+
+    s->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s->frames.store(v.frames, std::memory_order_relaxed);
+    s->frame_ns.store(v.frame_ns, std::memory_order_relaxed);
+    s->regen_ns.store(v.regen_ns, std::memory_order_relaxed);
+    s->upload_bytes.store(v.upload_bytes, std::memory_order_relaxed);
+    s->triangles.store(v.triangles, std::memory_order_relaxed);
+    s->dropped_frames.store(v.dropped_frames, std::memory_order_relaxed);
+
+    s->seq.store(seq + 2, std::memory_order_release);
+}
+
+inline void
+statsRead (Stats* s, StatsSample& v)
+{
+    uint32_t before, after;
+
+    do {
+        before = s->seq.load(std::memory_order_acquire);
+
+        v.frames = s->frames.load(std::memory_order_relaxed);
+        v.frame_ns = s->frame_ns.load(std::memory_order_relaxed);
+        v.regen_ns = s->regen_ns.load(std::memory_order_relaxed);
+        v.upload_bytes = s->upload_bytes.load(std::memory_order_relaxed);
+        v.triangles = s->triangles.load(std::memory_order_relaxed);
+        v.dropped_frames = s->dropped_frames.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = s->seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+#endif
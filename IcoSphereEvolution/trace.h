@@ -0,0 +1,227 @@
+#ifndef SPHERE_TRACE_H
+#define SPHERE_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Scoped trace events, written out in Chrome's trace event format for
+ * chrome://tracing or ui.perfetto.dev. Each thread keeps the last
+ * TRACE_RING_SIZE events in a ring of its own so recording never takes a
+ * lock. Until traceStart a TRACE scope costs one relaxed load, and building
+ * with -DNO_TRACE removes the scopes altogether.
+ */
+#define TRACE_RING_SIZE (1 << 16)
+
+#ifdef NO_TRACE
+#define TRACE(name)
+#else
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE(name) TraceScope TRACE_JOIN(trace_scope_, __LINE__)(name)
+#endif
+
+/* fields are atomic so the flush can read them while the thread writes */
+struct TraceEvent {
+    std::atomic<const char*> name;      /* a string literal */
+    std::atomic<uint64_t> start;        /* ns on the monotonic clock */
+    std::atomic<uint64_t> duration;
+};
+
+/*
+ * Only its own thread writes a ring. `head' counts every event ever written
+ * and is published after the event, so a reader keeps the events older than
+ * a full lap behind the `head' it sees once it has copied them.
+ */
+struct TraceRing {
+    const char* thread;
+    int tid;
+    std::atomic<uint64_t> head;
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+struct TraceState {
+    std::mutex lock;    /* taken once per thread to register, and to write */
+    std::vector<TraceRing*> rings;
+    const char* path;
+    uint64_t epoch;
+    pid_t owner;        /* only the process which started tracing writes */
+};
+
+/* What the calling thread is called and where it records */
+struct TraceThread {
+    const char* name;
+    TraceRing* ring;
+};
+
+inline std::atomic<bool>&
+traceEnabled ()
+{
+    static std::atomic<bool> enabled(false);
+    return enabled;
+}
+
+inline TraceState&
+traceState ()
+{
+    static TraceState state;
+    return state;
+}
+
+inline TraceThread&
+traceThread ()
+{
+    static thread_local TraceThread self = { NULL, NULL };
+    return self;
+}
+
+inline uint64_t
+traceNow ()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Name the calling thread in the trace, before it records anything */
+inline void
+traceName (const char* name)
+{
+    traceThread().name = name;
+}
+
+inline TraceRing*
+traceRegister ()
+{
+    TraceState& state = traceState();
+    TraceThread& self = traceThread();
+    std::lock_guard<std::mutex> l(state.lock);
+
+    self.ring = new TraceRing();
+    self.ring->thread = self.name ? self.name : "thread";
+    self.ring->tid = state.rings.size() + 1;
+    state.rings.push_back(self.ring);
+    return self.ring;
+}
+
+inline void
+traceRecord (const char* name, uint64_t start, uint64_t end)
+{
+    TraceRing* ring = traceThread().ring;
+    if (!ring)
+        ring = traceRegister();
+
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    TraceEvent& e = ring->events[h % TRACE_RING_SIZE];
+
+    /* pairs with the flush's fence: seeing this write means seeing `head' */
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name.store(name, std::memory_order_relaxed);
+    e.start.store(start, std::memory_order_relaxed);
+    e.duration.store(end - start, std::memory_order_relaxed);
+    ring->head.store(h + 1, std::memory_order_release);
+}
+
+class TraceScope {
+    public:
+        TraceScope(const char* name)
+            : name(name)
+            , start(traceEnabled().load(std::memory_order_relaxed) ? traceNow() : 0)
+        { }
+
+        ~TraceScope()
+        {
+            if (start)
+                traceRecord(name, start, traceNow());
+        }
+
+    protected:
+        const char* name;
+        uint64_t start;
+};
+
+/*
+ * Write every thread's recorded events to the path given to traceStart.
+ * Threads carry on recording meanwhile; events they overwrite are dropped.
+ */
+inline bool
+traceWrite ()
+{
+    TraceState& state = traceState();
+    std::lock_guard<std::mutex> l(state.lock);
+    int pid = getpid();
+    int count = 0;
+    FILE* file;
+
+    if (!state.path || !(file = fopen(state.path, "w")))
+        return false;
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (size_t r = 0; r < state.rings.size(); r++) {
+        TraceRing* ring = state.rings[r];
+        fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                count++ ? "," : "", pid, ring->tid, ring->thread);
+
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        std::vector<const char*> names;
+        std::vector<uint64_t> starts, durations;
+        for (uint64_t i = first; i < head; i++) {
+            TraceEvent& e = ring->events[i % TRACE_RING_SIZE];
+            names.push_back(e.name.load(std::memory_order_relaxed));
+            starts.push_back(e.start.load(std::memory_order_relaxed));
+            durations.push_back(e.duration.load(std::memory_order_relaxed));
+        }
+
+        /* the slot being written and any lapped since may be torn */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = ring->head.load(std::memory_order_relaxed);
+        uint64_t valid = now >= TRACE_RING_SIZE ? now - TRACE_RING_SIZE + 1 : 0;
+
+        for (uint64_t i = std::max(first, valid); i < head; i++) {
+            size_t k = i - first;
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, "
+                    "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    names[k], pid, ring->tid,
+                    (starts[k] - state.epoch) / 1e3, durations[k] / 1e3);
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    return fclose(file) == 0;
+}
+
+inline void
+traceExit ()
+{
+    TraceState& state = traceState();
+
+    /* a forked child exiting mustn't overwrite its parent's trace */
+    if (getpid() != state.owner)
+        return;
+    if (traceWrite())
+        fprintf(stderr, "trace written to %s\n", state.path);
+    else
+        fprintf(stderr, "Could not write trace to %s\n", state.path);
+}
+
+/* Start recording, to be written to `path' on traceWrite and at exit */
+inline void
+traceStart (const char* path)
+{
+    TraceState& state = traceState();
+    state.path = path;
+    state.epoch = traceNow();
+    state.owner = getpid();
+    traceEnabled().store(true);
+    atexit(traceExit);
+}
+
+#endif